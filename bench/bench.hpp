@@ -0,0 +1,73 @@
+// Shared pieces of the benchmarks in this directory. Each benchmark is a
+// single file. Build one from the repository root, for example:
+//
+//   c++ -std=c++17 -O2 -I. $(pkg-config --cflags freetype2) -o lookup bench/lookup.cpp $(pkg-config --libs freetype2) -lpthread
+//
+// and run it from the root as well, the fonts are read from example/.
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <math.h>
+
+#if defined(__GLIBCXX__)
+// libstdc++ does not declare std::expf, which fs_blur.hpp uses.
+namespace std { using ::expf; }
+#endif
+
+#include "fontstash/fontstash.hpp"
+
+namespace bench {
+    namespace fs = fontstash;
+
+    // Backend that keeps nothing, so only fontstash itself is timed.
+    struct NullParams : fs::FONSparams {
+        NullParams(int w, int h, unsigned char flags) :
+            FONSparams{w, h, flags}
+        {
+        }
+
+        int renderCreate(int, int) override { return 1; }
+        int renderResize(int, int) override { return 1; }
+        void renderUpdate(int*, const unsigned char*) override {}
+        void renderDraw(const float*, const float*, const unsigned int*, int) override {}
+        void renderDelete() override {}
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    inline double msSince(Clock::time_point t0)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    }
+
+    // Appends 'cp' to 's' as UTF-8.
+    inline void appendUtf8(std::string& s, unsigned int cp)
+    {
+        if (cp < 0x80)
+        {
+            s += (char)cp;
+        }
+        else if (cp < 0x800)
+        {
+            s += (char)(0xc0 | (cp >> 6));
+            s += (char)(0x80 | (cp & 0x3f));
+        }
+        else if (cp < 0x10000)
+        {
+            s += (char)(0xe0 | (cp >> 12));
+            s += (char)(0x80 | ((cp >> 6) & 0x3f));
+            s += (char)(0x80 | (cp & 0x3f));
+        }
+        else
+        {
+            s += (char)(0xf0 | (cp >> 18));
+            s += (char)(0x80 | ((cp >> 12) & 0x3f));
+            s += (char)(0x80 | ((cp >> 6) & 0x3f));
+            s += (char)(0x80 | (cp & 0x3f));
+        }
+    }
+}
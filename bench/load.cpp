@@ -0,0 +1,101 @@
+// Load time and resident memory of addFont, which maps the font file,
+// against reading the whole file and passing it to addFontMem, the old
+// path. RSS is taken from /proc/self/status after addFont and after the
+// first draw of "Hello 日本語" at 20px, so this runs on Linux only.
+//
+// Without arguments every font and mode runs 3 times, each in its own
+// process so the page cache is warm but the process starts clean, and
+// the median run is shown. "load mmap|read <font>" runs a single case.
+//
+// Build and run as described in bench.hpp.
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include "bench/bench.hpp"
+
+using namespace bench;
+
+static long rssKb()
+{
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp == nullptr) return 0;
+    char line[256];
+    long kb = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0) kb = atol(line + 6);
+    }
+    fclose(fp);
+    return kb;
+}
+
+static int runCase(bool mapped, const char* path)
+{
+    fs::FONScontext ctx(new NullParams(512, 512, fs::FONS_ZERO_TOPLEFT));
+    long rss0 = rssKb();
+    Clock::time_point t0 = Clock::now();
+    int f = fs::INVALID;
+    if (mapped)
+    {
+        f = ctx.addFont("f", path);
+    }
+    else
+    {
+        FILE* fp = fopen(path, "rb");
+        if (fp != nullptr)
+        {
+            fseek(fp, 0, SEEK_END);
+            long size = ftell(fp);
+            fseek(fp, 0, SEEK_SET);
+            unsigned char* data = (unsigned char*)calloc(size, 1);
+            if (data != nullptr && fread(data, 1, size, fp) == (size_t)size)
+                f = ctx.addFontMem("f", data, (int)size, 1);
+            else
+                free(data);
+            fclose(fp);
+        }
+    }
+    double ms = msSince(t0);
+    if (f == fs::INVALID)
+    {
+        fprintf(stderr, "cannot load %s\n", path);
+        return 1;
+    }
+    long rss1 = rssKb();
+    ctx.setFont(f);
+    ctx.setSize(20);
+    ctx.fonsDrawText(0, 0, "Hello 日本語", nullptr);
+    long rss2 = rssKb();
+    printf("%.3f %ld %ld\n", ms, rss1 - rss0, rss2 - rss0);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 3) return runCase(strcmp(argv[1], "mmap") == 0, argv[2]);
+
+    const char* fonts[] = {"example/DroidSerif-Regular.ttf", "example/DroidSansJapanese.ttf"};
+    for (const char* path : fonts)
+    {
+        printf("%s\n", path);
+        for (const char* mode : {"read", "mmap"})
+        {
+            struct Run { double ms; long load, draw; };
+            std::vector<Run> runs;
+            for (int rep = 0; rep < 3; ++rep)
+            {
+                std::string cmd = std::string("\"") + argv[0] + "\" " + mode + " " + path;
+                FILE* p = popen(cmd.c_str(), "r");
+                if (p == nullptr) return 1;
+                Run r;
+                int n = fscanf(p, "%lf %ld %ld", &r.ms, &r.load, &r.draw);
+                if (pclose(p) != 0 || n != 3) return 1;
+                runs.push_back(r);
+            }
+            std::sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.ms < b.ms; });
+            const Run& r = runs[1];
+            printf("  %s: %.2f ms, +%ld kB RSS (+%ld kB after the first draw)\n", mode, r.ms, r.load, r.draw);
+        }
+    }
+    return 0;
+}
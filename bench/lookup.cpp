@@ -0,0 +1,53 @@
+// Lookup cost of cached glyphs as the glyph table grows. Fills the table
+// of DroidSansJapanese with 100, 10k and 100k glyph records spread over
+// four sizes and two blurs, then times fons__getGlyph() on random hits.
+// The records are not rasterized, only the table is exercised.
+//
+// Build and run as described in bench.hpp.
+#include "bench/bench.hpp"
+
+using namespace bench;
+
+int main()
+{
+    fs::FONScontext ctx(new NullParams(512, 512, fs::FONS_ZERO_TOPLEFT));
+    int f = ctx.addFont("jp", "example/DroidSansJapanese.ttf");
+    if (f == fs::INVALID)
+    {
+        fprintf(stderr, "cannot load example/DroidSansJapanese.ttf, run from the repository root\n");
+        return 1;
+    }
+    fs::FONSfont* font = ctx.fonts[f].get();
+
+    for (int n : {100, 10000, 100000})
+    {
+        font->nglyphs = 0;
+        font->lut.clear();
+        for (int i = 0; i < n; ++i)
+        {
+            unsigned int cp = 0x4E00 + i/8;
+            short isize = (short)(120 + (i%4)*60), iblur = (short)((i/4)%2);
+            fs::FONSglyph* g = font->allocGlyph();
+            memset(g, 0, sizeof(*g));
+            g->codepoint = cp;
+            g->size = isize;
+            g->blur = iblur;
+            g->index = i;
+            font->lut.insert(fs::FONSglyph::key(cp, isize, iblur), font->nglyphs-1);
+        }
+
+        const int iters = 2000000;
+        unsigned int sum = 0, seed = 1;
+        Clock::time_point t0 = Clock::now();
+        for (int k = 0; k < iters; ++k)
+        {
+            seed = seed*1664525u + 1013904223u;
+            int i = (int)((seed >> 8) % n);
+            fs::FONSglyph* g = fs::fons__getGlyph(&ctx, font, 0x4E00 + i/8, (short)(120 + (i%4)*60), (short)((i/4)%2));
+            sum += g->index;
+        }
+        double ms = msSince(t0);
+        printf("%7d cached glyphs: %6.1f ns/lookup (%u)\n", n, ms * 1e6 / iters, sum & 1);
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Speed-up of batch rasterization versus thread count. Draws 600 cold
+// CJK glyphs of DroidSansJapanese at 32px with setRasterThreads(n) for
+// n = 1, 2, 4, 8 and hardware_concurrency(), best of 5 runs each. Every
+// pooled atlas is also compared with the serial one, with and without
+// blur. Speed-up needs as many free cores as threads.
+//
+// Build and run as described in bench.hpp.
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "bench/bench.hpp"
+
+using namespace bench;
+
+static const char* fontPath = "example/DroidSansJapanese.ttf";
+
+static std::string cjkText()
+{
+    std::string s;
+    for (unsigned int cp = 0x4E00; cp < 0x4E00 + 600; ++cp)
+        appendUtf8(s, cp);
+    return s;
+}
+
+static std::vector<unsigned char> renderAtlas(const std::string& text, int threads, float blur)
+{
+    fs::FONScontext ctx(new NullParams(2048, 2048, fs::FONS_ZERO_TOPLEFT));
+    int f = ctx.addFont("jp", fontPath);
+    ctx.setRasterThreads(threads);
+    ctx.setFont(f);
+    ctx.setSize(24);
+    ctx.setBlur(blur);
+    ctx.fonsDrawText(10, 10, text.c_str(), nullptr);
+    int w, h;
+    const unsigned char* data = ctx.fonsGetTextureData(&w, &h);
+    return std::vector<unsigned char>(data, data + w*h);
+}
+
+static double drawCold(const std::string& text, int threads)
+{
+    double best = 1e30;
+    for (int rep = 0; rep < 5; ++rep)
+    {
+        fs::FONScontext ctx(new NullParams(4096, 4096, fs::FONS_ZERO_TOPLEFT));
+        int f = ctx.addFont("jp", fontPath);
+        ctx.setRasterThreads(threads);
+        ctx.setFont(f);
+        ctx.setSize(32);
+        ctx.fonsDrawText(0, 0, "warm", nullptr);
+        Clock::time_point t0 = Clock::now();
+        ctx.fonsDrawText(10, 10, text.c_str(), nullptr);
+        best = std::min(best, msSince(t0));
+    }
+    return best;
+}
+
+int main()
+{
+    std::string text = cjkText();
+    {
+        fs::FONScontext probe(new NullParams(64, 64, fs::FONS_ZERO_TOPLEFT));
+        if (probe.addFont("jp", fontPath) == fs::INVALID)
+        {
+            fprintf(stderr, "cannot load %s, run from the repository root\n", fontPath);
+            return 1;
+        }
+    }
+
+    for (float blur : {0.0f, 3.0f})
+    {
+        std::vector<unsigned char> serial = renderAtlas(text, 1, blur);
+        for (int threads : {2, 4, 8})
+        {
+            bool same = renderAtlas(text, threads, blur) == serial;
+            printf("blur %g, %d threads: atlas %s\n", blur, threads, same ? "identical to serial" : "DIFFERS from serial");
+        }
+    }
+
+    unsigned int cores = std::thread::hardware_concurrency();
+    std::vector<int> counts{1, 2, 4, 8};
+    if (cores > 8) counts.push_back((int)cores);
+    printf("hardware_concurrency %u\n", cores);
+    double serial = 0.0;
+    for (int threads : counts)
+    {
+        double ms = drawCold(text, threads);
+        if (threads == 1) serial = ms;
+        printf("%2d threads: 600 cold glyphs in %6.2f ms, speed-up %.2fx\n", threads, ms, serial / ms);
+    }
+    return 0;
+}
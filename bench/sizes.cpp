@@ -0,0 +1,49 @@
+// Cold rasterization with interleaved sizes. Renders the 94 printable
+// ASCII glyphs of DroidSerif-Regular at 124/48/24/12/18 px into a reset
+// atlas, once switching size on every glyph and once size by size. With
+// one FT_Size per pixel size both orders should cost about the same.
+// Best of 5 runs.
+//
+// Build and run as described in bench.hpp.
+#include <algorithm>
+#include "bench/bench.hpp"
+
+using namespace bench;
+
+int main()
+{
+    const short sizes[] = {1240, 480, 240, 120, 180};
+    fs::FONScontext ctx(new NullParams(4096, 4096, fs::FONS_ZERO_TOPLEFT));
+    int f = ctx.addFont("serif", "example/DroidSerif-Regular.ttf");
+    if (f == fs::INVALID)
+    {
+        fprintf(stderr, "cannot load example/DroidSerif-Regular.ttf, run from the repository root\n");
+        return 1;
+    }
+    fs::FONSfont* font = ctx.fonts[f].get();
+
+    for (int interleaved = 1; interleaved >= 0; --interleaved)
+    {
+        double best = 1e30;
+        int n = 0;
+        for (int rep = 0; rep < 5; ++rep)
+        {
+            ctx.fonsResetAtlas(4096, 4096);
+            n = 0;
+            Clock::time_point t0 = Clock::now();
+            if (interleaved)
+            {
+                for (unsigned int cp = 33; cp < 127; ++cp)
+                    for (short s : sizes) { fs::fons__getGlyph(&ctx, font, cp, s, 0); n++; }
+            }
+            else
+            {
+                for (short s : sizes)
+                    for (unsigned int cp = 33; cp < 127; ++cp) { fs::fons__getGlyph(&ctx, font, cp, s, 0); n++; }
+            }
+            best = std::min(best, msSince(t0));
+        }
+        printf("%-11s %d cold glyphs: %.2f ms, %.2f us/glyph\n", interleaved ? "interleaved" : "grouped", n, best, best * 1000 / n);
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+// UTF-8 decoding throughput in bytes per nanosecond. Decodes 64 KiB
+// corpora of ASCII, Latin-1, mixed script and CJK words three ways:
+// decutf8() fed byte by byte, FONSutf8Reader, and decutf8Block() into a
+// 64 codepoint buffer. The corpora are generated, not read from disk.
+//
+// Build and run as described in bench.hpp.
+#include <random>
+#include "bench/bench.hpp"
+
+using namespace bench;
+
+enum Corpus { ASCII, LATIN1, MIXED, CJK };
+
+// Words of 2 to 9 letters separated by spaces or punctuation, closer to
+// UI strings than independent random characters.
+static std::string makeCorpus(Corpus kind)
+{
+    std::string s;
+    std::mt19937 rng(7);
+    while (s.size() < (1u << 16))
+    {
+        // 0 Latin, 1 Cyrillic, 2 CJK, 3 emoji.
+        int script = 0;
+        if (kind == MIXED)
+        {
+            int k = rng() % 20;
+            script = k < 14 ? 0 : k < 17 ? 1 : k < 19 ? 2 : 3;
+        }
+        else if (kind == CJK)
+        {
+            script = rng() % 10 ? 2 : 0;
+        }
+        int len = 2 + rng() % 8;
+        for (int i = 0; i < len; ++i)
+        {
+            unsigned int cp;
+            switch (script)
+            {
+            case 0: cp = kind == LATIN1 && rng() % 8 == 0 ? 0xc0 + rng() % 0x40 : 'a' + rng() % 26; break;
+            case 1: cp = 0x430 + rng() % 32; break;
+            case 2: cp = 0x4e00 + rng() % 0x5000; break;
+            default: cp = 0x1f600 + rng() % 0x50; break;
+            }
+            appendUtf8(s, cp);
+        }
+        if (kind == CJK)
+            appendUtf8(s, rng() % 4 ? 0x3001 : 0x3002);
+        else
+            s += rng() % 10 ? " " : ". ";
+    }
+    return s;
+}
+
+int main()
+{
+    const char* names[] = {"ascii", "latin1", "mixed", "cjk"};
+    const int reps = 1000;
+    unsigned int sum = 0;
+
+    printf("%-8s %10s %10s %10s  (bytes/ns)\n", "corpus", "decutf8", "reader", "block");
+    for (Corpus kind : {ASCII, LATIN1, MIXED, CJK})
+    {
+        std::string text = makeCorpus(kind);
+        const char* begin = text.data();
+        const char* end = begin + text.size();
+        double bytes = (double)text.size() * reps;
+
+        Clock::time_point t0 = Clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            unsigned int state = fs::UTF8_ACCEPT, cp = 0;
+            for (const char* p = begin; p != end; ++p)
+            {
+                if (fs::decutf8(&state, &cp, *(const unsigned char*)p) == fs::UTF8_ACCEPT)
+                    sum += cp;
+            }
+        }
+        double scalarMs = msSince(t0);
+
+        t0 = Clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            fs::FONSutf8Reader reader(begin, end);
+            unsigned int cp;
+            while (reader.next(&cp))
+                sum += cp;
+        }
+        double readerMs = msSince(t0);
+
+        t0 = Clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            unsigned int state = fs::UTF8_ACCEPT, cp = 0, block[64];
+            const char* p = begin;
+            while (p != end)
+            {
+                int n = fs::decutf8Block(&state, &cp, &p, end, block, 64);
+                for (int i = 0; i < n; ++i)
+                    sum += block[i];
+            }
+        }
+        double blockMs = msSince(t0);
+
+        printf("%-8s %10.2f %10.2f %10.2f\n", names[kind],
+               bytes / (scalarMs * 1e6), bytes / (readerMs * 1e6), bytes / (blockMs * 1e6));
+    }
+    // Keeps the loops from being optimized away.
+    printf("checksum %u\n", sum);
+    return 0;
+}
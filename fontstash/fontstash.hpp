@@ -3,11 +3,20 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_ADVANCES_H
+#include FT_OUTLINE_H
+#include FT_SIZES_H
 #include <cmath>
-
+#include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "fontstash/fs_cache.hpp"
+#include "fontstash/fs_cmap.hpp"
+#include "fontstash/fs_hash.hpp"
+#include "fontstash/fs_mmap.hpp"
+#include "fontstash/fs_util.hpp"
+
 #ifndef FONS_SCRATCH_BUF_SIZE
 #   define FONS_SCRATCH_BUF_SIZE 64000
 #endif
@@ -23,15 +32,35 @@
 #ifndef FONS_INIT_ATLAS_NODES
 #   define FONS_INIT_ATLAS_NODES 256
 #endif
+// Initial size of vertex batches, they grow up to FONS_MAX_VERTEX_COUNT.
 #ifndef FONS_VERTEX_COUNT
 #   define FONS_VERTEX_COUNT 1024
 #endif
+// Default vertex limit of a batch, see FONScontext::setVertexLimit(). With
+// FONS_INDEXED_QUADS batches stop at 65536 vertices whatever the limit, the
+// backends draw them with 16-bit indices.
+#ifndef FONS_MAX_VERTEX_COUNT
+#   define FONS_MAX_VERTEX_COUNT 65536
+#endif
 #ifndef FONS_MAX_STATES
 #   define FONS_MAX_STATES 20
 #endif
 #ifndef FONS_MAX_FALLBACKS
 #   define FONS_MAX_FALLBACKS 20
 #endif
+#ifndef FONS_MAX_PAGES
+#   define FONS_MAX_PAGES 8
+#endif
+#ifndef FONS_MAX_FT_SIZES
+#   define FONS_MAX_FT_SIZES 8
+#endif
+#ifndef FONS_MAX_RASTER_THREADS
+#   define FONS_MAX_RASTER_THREADS 16
+#endif
+// Codepoints FONScontext::prewarm() measures and rasterizes at a time.
+#ifndef FONS_PREWARM_CHUNK
+#   define FONS_PREWARM_CHUNK 256
+#endif
 
 namespace fontstash {
     static constexpr int INVALID = -1;
@@ -39,6 +68,24 @@ namespace fontstash {
     enum FONSflags {
         FONS_ZERO_TOPLEFT = 1,
         FONS_ZERO_BOTTOMLEFT = 2,
+        // When the atlas is full, evict glyphs not used in the current frame
+        // (least recently used first) instead of reporting FONS_ATLAS_FULL.
+        FONS_EVICT_LRU = 4,
+        // Emit 4 vertices per glyph instead of 6 and draw them through
+        // FONSparams::renderDrawIndexed with FONS_QUAD_INDICES.
+        FONS_INDEXED_QUADS = 8,
+        // Emit one FONSinstance per glyph and draw them through
+        // FONSparams::renderDrawInstanced, the quads are expanded there.
+        FONS_INSTANCED_QUADS = 16,
+        // Collect the draws of a frame per atlas page and submit them from
+        // endFrame(), or earlier when the atlas changes under them. Draw order
+        // is kept within a page but not across pages.
+        FONS_DEFER_DRAWS = 32,
+        // Let the backend stage atlas updates and upload them asynchronously.
+        // The GL backends copy dirty regions into alternating pixel buffer
+        // objects instead of uploading from client memory. glfontstash.hpp
+        // only does so when built with GLFONS_PIXEL_BUFFERS.
+        FONS_ASYNC_UPLOADS = 64,
     };
 
     enum FONSalign {
@@ -64,6 +111,85 @@ namespace fontstash {
         FONS_STATES_UNDERFLOW = 4,
     };
 
+    struct FONSquad {
+        float x0,y0,s0,t0;
+        float x1,y1,s1,t1;
+        int page;
+    };
+
+    // Interleaved vertex, 20 bytes: position, texture coordinates and RGBA
+    // color packed as in the separate 'colors' array.
+    struct FONSvertex {
+        float x, y;
+        float s, t;
+        unsigned int c;
+    };
+
+    // One glyph for instanced drawing, 16 bytes. Glyph quads are placed on
+    // whole pixels and map atlas texels 1:1, so the quad is fully described
+    // by its first corner and the atlas rect (u0,v0)-(u1,v1) in texels. The
+    // quad extends down from 'y' with FONS_ZERO_TOPLEFT and up otherwise.
+    struct FONSinstance {
+        short x, y;
+        unsigned short u0, v0, u1, v1;
+        unsigned int c;
+    };
+
+    // Expands 'inst' to the quad fonsDrawText would have emitted for it.
+    inline void fonsInstanceQuad(const FONSinstance& inst, unsigned char flags, int atlasWidth, int atlasHeight, FONSquad* q)
+    {
+        float itw = 1.0f / atlasWidth;
+        float ith = 1.0f / atlasHeight;
+        float w = (float)(inst.u1 - inst.u0);
+        float h = (float)(inst.v1 - inst.v0);
+        q->x0 = (float)inst.x;
+        q->y0 = (float)inst.y;
+        q->x1 = q->x0 + w;
+        q->y1 = (flags & FONS_ZERO_TOPLEFT) ? q->y0 + h : q->y0 - h;
+        q->s0 = inst.u0 * itw;
+        q->t0 = inst.v0 * ith;
+        q->s1 = inst.u1 * itw;
+        q->t1 = inst.v1 * ith;
+        q->page = INVALID;
+    }
+
+    // Caller-owned storage for vertex batches, see FONScontext::setVertexArena().
+    // The arrays hold 'capacity' vertices, 'instances' may be null unless
+    // FONS_INSTANCED_QUADS is used.
+    struct FONSvertexArena {
+        float* verts;
+        float* tcoords;
+        unsigned int* colors;
+        FONSinstance* instances;
+        int capacity;
+    };
+
+    // Counters for sizing vertex storage, see FONScontext::vertexStats().
+    struct FONSvertexStats {
+        int draws;          // Batches handed to the backend.
+        int limitFlushes;   // Batches cut short by the vertex limit or arena.
+        int grows;          // Times vertex storage was reallocated.
+        int peakVertices;   // Most vertices in one batch.
+        int peakInstances;  // Most instances in one batch.
+    };
+
+    // Corners of an indexed quad come in the order (x0,y0) (x1,y0) (x1,y1)
+    // (x0,y1). These are the triangles of quad 0, add 4*i for quad i. They
+    // have the same winding as the 6 vertices of non-indexed glyphs.
+    static constexpr unsigned short FONS_QUAD_INDICES[6] = {0, 2, 1, 0, 3, 2};
+
+    // Fills 'dst' with the indices of 'nquads' consecutive quads.
+    inline void fonsQuadIndices(unsigned short* dst, int nquads)
+    {
+        for (int q = 0; q < nquads; ++q)
+        {
+            for (int k = 0; k < 6; ++k)
+            {
+                dst[q*6+k] = (unsigned short)(q*4 + FONS_QUAD_INDICES[k]);
+            }
+        }
+    }
+
     struct FONSparams {
         FONSparams(int w, int h, unsigned char f) :
             width{w},
@@ -79,16 +205,101 @@ namespace fontstash {
         virtual void renderDraw( const float* verts, const float* tcoords, const unsigned int* colors, int nverts) = 0;
         virtual void renderDelete() = 0;
 
+        // Multi-page atlases. Page 0 is the texture made by renderCreate,
+        // renderAddPage should create texture (or array layer) 'page' with the
+        // current size and return 1, or 0 if the backend only has one page.
+        // renderResize applies to every page.
+        virtual int renderAddPage(int page)
+        {
+            (void)page;
+            return 0;
+        }
+        virtual void renderUpdatePage(int page, int* rect, const unsigned char* data)
+        {
+            if (page == 0) renderUpdate(rect, data);
+        }
+        virtual void renderDrawPage(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            if (page == 0) renderDraw(verts, tcoords, colors, nverts);
+        }
+        // Uploads the changed parts of 'page', 'rects' holds x0,y0,x1,y1 of
+        // 'nrects' disjoint rects and 'data' is the whole page as for
+        // renderUpdatePage, which the default calls once per rect.
+        virtual void renderUpdateRects(int page, const int* rects, int nrects, const unsigned char* data)
+        {
+            for (int i = 0; i < nrects; ++i)
+            {
+                int rect[4] = {rects[i*4+0], rects[i*4+1], rects[i*4+2], rects[i*4+3]};
+                renderUpdatePage(page, rect, data);
+            }
+        }
+
+        // Draws 'nverts'/4 quads of 'page' with FONS_INDEXED_QUADS. The default
+        // expands them to triangles for renderDrawPage, backends with index
+        // buffers should draw them with fonsQuadIndices() instead.
+        virtual void renderDrawIndexed(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            int ntris = nverts / 4 * 6;
+            std::vector<float> v(ntris*2), t(ntris*2);
+            std::vector<unsigned int> c(ntris);
+            for (int i = 0; i < ntris; ++i)
+            {
+                int j = i / 6 * 4 + FONS_QUAD_INDICES[i % 6];
+                v[i*2+0] = verts[j*2+0];
+                v[i*2+1] = verts[j*2+1];
+                t[i*2+0] = tcoords[j*2+0];
+                t[i*2+1] = tcoords[j*2+1];
+                c[i] = colors[j];
+            }
+            renderDrawPage(page, v.data(), t.data(), c.data(), ntris);
+        }
+
+        // Draws 'ninstances' glyphs of 'page' with FONS_INSTANCED_QUADS. The
+        // default expands them to triangles for renderDrawPage.
+        virtual void renderDrawInstanced(int page, const FONSinstance* instances, int ninstances)
+        {
+            std::vector<float> v(ninstances*12), t(ninstances*12);
+            std::vector<unsigned int> c(ninstances*6);
+            for (int i = 0; i < ninstances; ++i)
+            {
+                FONSquad q;
+                fonsInstanceQuad(instances[i], flags, width, height, &q);
+                const float corners[12] = {q.x0,q.y0, q.x1,q.y1, q.x1,q.y0, q.x0,q.y0, q.x0,q.y1, q.x1,q.y1};
+                const float uvs[12] = {q.s0,q.t0, q.s1,q.t1, q.s1,q.t0, q.s0,q.t0, q.s0,q.t1, q.s1,q.t1};
+                memcpy(&v[i*12], corners, sizeof(corners));
+                memcpy(&t[i*12], uvs, sizeof(uvs));
+                for (int k = 0; k < 6; ++k) c[i*6+k] = instances[i].c;
+            }
+            renderDrawPage(page, v.data(), t.data(), c.data(), ninstances*6);
+        }
+
+        // Zero-copy vertex sink. renderMapVertices should return room for
+        // 'minVerts' interleaved vertices sampling 'page', or as many as it
+        // has, typically a pointer into a mapped vertex buffer, and store how
+        // many fit in 'capacity'. The request grows while batches fill their
+        // buffer, up to FONScontext::setVertexLimit(). Vertices are written
+        // there once and handed back with renderDrawVertices, which draws the
+        // first 'nverts' of them, 4 per quad with FONS_INDEXED_QUADS. Return
+        // nullptr to receive separate arrays through renderDrawPage or
+        // renderDrawIndexed instead.
+        virtual FONSvertex* renderMapVertices(int page, int minVerts, int* capacity)
+        {
+            (void)page;
+            (void)minVerts;
+            *capacity = 0;
+            return nullptr;
+        }
+        virtual void renderDrawVertices(int page, int nverts)
+        {
+            (void)page;
+            (void)nverts;
+        }
+
         int             width,
                         height;
         unsigned char   flags;
     };
 
-    struct FONSquad {
-        float x0,y0,s0,t0;
-        float x1,y1,s1,t1;
-    };
-
     struct FONScontext;
 }
 namespace fontstash {
@@ -96,39 +307,106 @@ namespace fontstash {
     static FT_Library ftLibrary;
 
     struct FONSglyph {
+        // Packs the glyph cache key, (codepoint, size, blur), into 64 bits.
+        static uint64_t key(unsigned int codepoint, short isize, short iblur)
+        {
+            return (static_cast<uint64_t>(codepoint) << 32) |
+                   (static_cast<uint64_t>(static_cast<unsigned short>(isize)) << 16) |
+                   static_cast<uint64_t>(static_cast<unsigned short>(iblur));
+        }
+
         unsigned int codepoint;
         int index;
-        int next;
+        short page;
+        // Font the glyph comes from, 0 for the font itself and i for its
+        // i-th fallback. 'index' is a glyph index in that font's face.
+        short fallback;
         short size, blur;
         short x0,y0,x1,y1;
         short xadv,xoff,yoff;
+        // Frame in which the glyph was last looked up, see FONScontext::endFrame().
+        unsigned int lastUse;
     };
 
 
-    struct FONSfont
+    // Advance and bitmap bounds of a glyph at one size, measured without
+    // rasterizing. Bounds are relative to the pen position and exclude padding.
+    struct FONSglyphMetrics {
+        int index;
+        short fallback;     // Like FONSglyph::fallback.
+        short xadv;
+        short x0,y0,x1,y1;
+    };
+
+    // A loaded font file: the font data, its FreeType face and everything
+    // derived from them that does not depend on a context. Faces are shared
+    // between contexts through FONSfontRegistry. Like FT_Face itself a face
+    // must only be used by one thread at a time.
+    struct FONSface
     {
-        FONSglyph* allocGlyph()
+        FONSface() :
+            data{nullptr},
+            dataSize{0},
+            freeData{0},
+            ascender{0},
+            descender{0},
+            lineh{0},
+            font_{nullptr},
+            mapping{},
+            sizes_{},
+            nsizes_{0},
+            activeSize_{0},
+            sizeClock_{0},
+            hasKerning_{false},
+            dataHash_{0},
+            metrics_{FONS_HASH_LUT_SIZE}
         {
-            if (nglyphs + 1 > cglyphs)
+        }
+
+        FONSface(const FONSface&) = delete;
+        FONSface& operator=(const FONSface&) = delete;
+
+        ~FONSface()
+        {
+            if (font_) FT_Done_Face(font_);
+            if (freeData && data) free(data);
+        }
+
+        // Creates the face over 'data' and measures it. With 'freeData' the
+        // face owns 'data', also when loading fails.
+        bool load(unsigned char* fontData, int fontDataSize, int freeFontData)
+        {
+            int ascent, descent, fh, lineGap;
+            data = fontData;
+            dataSize = fontDataSize;
+            freeData = static_cast<unsigned char>(freeFontData);
+            if (FT_New_Memory_Face(ftLibrary, static_cast<const FT_Byte*>(data), dataSize, 0, &font_))
             {
-                cglyphs = cglyphs == 0 ? 8 : cglyphs * 2;
-                glyphs = (FONSglyph*)realloc(glyphs, sizeof(FONSglyph) * cglyphs);
-                if (glyphs == nullptr)
-                {
-                    return nullptr;
-                }
+                font_ = nullptr;
+                return false;
             }
-            nglyphs++;
-            return &glyphs[nglyphs-1];
+            // Store normalized line height. The real line height is got
+            // by multiplying the lineh by font size.
+            getFontVMetrics(&ascent, &descent, &lineGap);
+            fh = ascent - descent;
+            ascender = (float)ascent / (float)fh;
+            descender = (float)descent / (float)fh;
+            lineh = (float)(fh + lineGap) / (float)fh;
+            buildKerning();
+            return true;
         }
-        bool loadFont(FONScontext *context, const unsigned char *data, int dataSize)
-        {
-            (void)(context);
 
-            //font->font.userdata = stash;
-            FT_Error ft_error = FT_New_Memory_Face(ftLibrary, static_cast<const FT_Byte*>(data), dataSize, 0, &font_);
-            return ft_error == 0;
+        // Maps or reads the font file at 'path' and loads it.
+        bool loadFile(const char* path);
+
+        // Hash of the font data, identifies the font in cache files.
+        uint64_t dataHash()
+        {
+            if (dataHash_ == 0 && data != nullptr)
+                dataHash_ = hashBytes(data, dataSize) | 1;
+            return dataHash_;
         }
+
         void getFontVMetrics(int *ascent, int *descent, int *lineGap)
         {
             *ascent = font_->ascender;
@@ -141,9 +419,94 @@ namespace fontstash {
             return size / (font_->ascender - font_->descender);
         }
 
-        int getGlyphIndex(int codepoint)
+        int getGlyphIndex(unsigned int codepoint)
+        {
+            int slot, glyph;
+            if (!cmap_.find(codepoint, &slot, &glyph))
+            {
+                glyph = FT_Get_Char_Index(font_, codepoint);
+                cmap_.insert(codepoint, 0, glyph);
+            }
+            return glyph;
+        }
+
+        // Advance and bitmap bounds of a glyph at a size in tenths of a pixel,
+        // measured once per face. Returns null if FreeType cannot load the
+        // glyph, nothing is cached then so a later call tries again.
+        const FONSglyphMetrics* getGlyphMetrics(int glyph, short isize)
+        {
+            uint64_t key = (static_cast<uint64_t>(glyph) << 32) | static_cast<unsigned short>(isize);
+            if (FONSglyphMetrics* found = metrics_.find(key)) return found;
+
+            int advance = 0, x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+            float size = isize/10.0f;
+            if (!buildGlyphMetrics(glyph, size, &advance, &x0, &y0, &x1, &y1)) return nullptr;
+            FONSglyphMetrics m;
+            m.index = glyph;
+            m.fallback = 0;
+            m.xadv = (short)(getPixelHeightScale(size) * advance * 10.0f);
+            m.x0 = (short)x0;
+            m.y0 = (short)y0;
+            m.x1 = (short)x1;
+            m.y1 = (short)y1;
+            metrics_.insert(key, m);
+            return metrics_.find(key);
+        }
+
+        FT_UInt getPixelSize(float size) const
         {
-            return FT_Get_Char_Index(font_, codepoint);
+            return static_cast<FT_UInt>(size * static_cast<float>(font_->units_per_EM) / static_cast<float>(font_->ascender - font_->descender));
+        }
+
+        // Makes the FT_Size for 'size' current. Each pixel size gets its own
+        // FT_Size, so switching between sizes does not redo the scaling setup.
+        bool activateSize(float size)
+        {
+            FT_UInt pixels = getPixelSize(size);
+            if (pixels == activeSize_ && nsizes_ > 0) return true;
+
+            FONSftSize* slot = nullptr;
+            for (int i = 0; i < nsizes_; ++i)
+            {
+                if (sizes_[i].pixels == pixels)
+                {
+                    slot = &sizes_[i];
+                    break;
+                }
+            }
+            if (slot == nullptr)
+            {
+                FT_Size ft_size;
+                if (FT_New_Size(font_, &ft_size)) return false;
+                if (FT_Activate_Size(ft_size) || FT_Set_Pixel_Sizes(font_, 0, pixels))
+                {
+                    FT_Done_Size(ft_size);
+                    return false;
+                }
+                if (nsizes_ < FONS_MAX_FT_SIZES)
+                {
+                    slot = &sizes_[nsizes_++];
+                }
+                else
+                {
+                    // Replace the least recently used size.
+                    slot = &sizes_[0];
+                    for (int i = 1; i < nsizes_; ++i)
+                    {
+                        if (sizes_[i].lastUse < slot->lastUse) slot = &sizes_[i];
+                    }
+                    FT_Done_Size(slot->size);
+                }
+                slot->pixels = pixels;
+                slot->size = ft_size;
+            }
+            else if (FT_Activate_Size(slot->size))
+            {
+                return false;
+            }
+            slot->lastUse = ++sizeClock_;
+            activeSize_ = pixels;
+            return true;
         }
 
         bool buildGlyphBitmap(int glyph, float size, float scale, int *advance, int *lsb, int *x0, int *y0, int *x1, int *y1)
@@ -152,9 +515,8 @@ namespace fontstash {
             FT_GlyphSlot ft_glyph;
             FT_Fixed adv_fixed;
 
-            FT_Error ft_error = FT_Set_Pixel_Sizes(font_, 0, static_cast<FT_UInt>(size * static_cast<float>(font_->units_per_EM) / static_cast<float>(font_->ascender - font_->descender)));
-            if (ft_error) return false;
-            ft_error = FT_Load_Glyph(font_, glyph, FT_LOAD_RENDER);
+            if (!activateSize(size)) return false;
+            FT_Error ft_error = FT_Load_Glyph(font_, glyph, FT_LOAD_RENDER);
             if (ft_error) return false;
             ft_error = FT_Get_Advance(font_, glyph, FT_LOAD_NO_SCALE, &adv_fixed);
             if (ft_error) return false;
@@ -168,6 +530,46 @@ namespace fontstash {
             return true;
         }
 
+        bool buildGlyphMetrics(int glyph, float size, int *advance, int *x0, int *y0, int *x1, int *y1)
+        {
+            FT_Fixed adv_fixed;
+
+            if (!activateSize(size)) return false;
+            // Load the outline only, the bitmap bounds are computed from it.
+            FT_Error ft_error = FT_Load_Glyph(font_, glyph, FT_LOAD_DEFAULT);
+            if (ft_error) return false;
+            ft_error = FT_Get_Advance(font_, glyph, FT_LOAD_NO_SCALE, &adv_fixed);
+            if (ft_error) return false;
+            FT_GlyphSlot ft_glyph = font_->glyph;
+            *advance = static_cast<int>(adv_fixed);
+#if FREETYPE_MAJOR > 2 || (FREETYPE_MAJOR == 2 && FREETYPE_MINOR >= 10)
+            // FreeType presets the bitmap dimensions the renderer will produce.
+            *x0 = ft_glyph->bitmap_left;
+            *x1 = *x0 + ft_glyph->bitmap.width;
+            *y0 = -ft_glyph->bitmap_top;
+            *y1 = *y0 + ft_glyph->bitmap.rows;
+#else
+            if (ft_glyph->format == FT_GLYPH_FORMAT_OUTLINE)
+            {
+                // Same rounding as the smooth renderer.
+                FT_BBox cbox;
+                FT_Outline_Get_CBox(&ft_glyph->outline, &cbox);
+                *x0 = static_cast<int>(cbox.xMin >> 6);
+                *x1 = static_cast<int>((cbox.xMax + 63) >> 6);
+                *y0 = -static_cast<int>((cbox.yMax + 63) >> 6);
+                *y1 = -static_cast<int>(cbox.yMin >> 6);
+            }
+            else
+            {
+                *x0 = ft_glyph->bitmap_left;
+                *x1 = *x0 + ft_glyph->bitmap.width;
+                *y0 = -ft_glyph->bitmap_top;
+                *y1 = *y0 + ft_glyph->bitmap.rows;
+            }
+#endif
+            return true;
+        }
+
         void renderGlyphBitmap(unsigned char *output, int outWidth, int outHeight, int outStride, float scaleX, float scaleY, int glyph)
         {
             (void)(outWidth);
@@ -187,31 +589,164 @@ namespace fontstash {
             }
         }
 
+        // Precomputes kerning between the printable ASCII glyphs, the pairs
+        // that dominate Latin text. Called once after the face is loaded.
+        void buildKerning()
+        {
+            hasKerning_ = FT_HAS_KERNING(font_) != 0;
+            kernSlots_.clear();
+            kernAscii_.clear();
+            kernPairs_.clear();
+            if (!hasKerning_) return;
+
+            int asciiGlyphs[KERN_ASCII_COUNT];
+            int maxIndex = 0;
+            for (int i = 0; i < KERN_ASCII_COUNT; ++i)
+            {
+                asciiGlyphs[i] = getGlyphIndex(32 + i);
+                maxIndex = maxi(maxIndex, asciiGlyphs[i]);
+            }
+            kernSlots_.assign(maxIndex + 1, -1);
+            for (int i = 0; i < KERN_ASCII_COUNT; ++i)
+            {
+                if (asciiGlyphs[i] != 0) kernSlots_[asciiGlyphs[i]] = (signed char)i;
+            }
+            kernAscii_.assign(KERN_ASCII_COUNT * KERN_ASCII_COUNT, 0);
+            for (int i = 0; i < KERN_ASCII_COUNT; ++i)
+            {
+                for (int j = 0; j < KERN_ASCII_COUNT; ++j)
+                {
+                    kernAscii_[i * KERN_ASCII_COUNT + j] = (short)loadKerning(asciiGlyphs[i], asciiGlyphs[j]);
+                }
+            }
+        }
+
+        // Returns kerning between two glyphs in font units, scale it by
+        // getPixelHeightScale() to get pixels.
         int getGlyphKernAdvance(int glyph1, int glyph2)
+        {
+            if (!hasKerning_) return 0;
+            if (glyph1 < (int)kernSlots_.size() && glyph2 < (int)kernSlots_.size())
+            {
+                int s1 = kernSlots_[glyph1], s2 = kernSlots_[glyph2];
+                if (s1 >= 0 && s2 >= 0) return kernAscii_[s1 * KERN_ASCII_COUNT + s2];
+            }
+            uint64_t key = (static_cast<uint64_t>(glyph1) << 32) | static_cast<uint32_t>(glyph2);
+            if (int* kern = kernPairs_.find(key)) return *kern;
+            int kern = loadKerning(glyph1, glyph2);
+            kernPairs_.insert(key, kern);
+            return kern;
+        }
+
+        int loadKerning(int glyph1, int glyph2)
         {
             FT_Vector ft_kerning;
-            FT_Get_Kerning(font_, glyph1, glyph2, FT_KERNING_DEFAULT, &ft_kerning);
-            return static_cast<int>((ft_kerning.x + 32) >> 6);  // Round up and convert to integer
+            if (FT_Get_Kerning(font_, glyph1, glyph2, FT_KERNING_UNSCALED, &ft_kerning)) return 0;
+            return static_cast<int>(ft_kerning.x);
         }
 
-        char name[64];
         unsigned char* data;
         int dataSize;
         unsigned char freeData;
         float ascender;
         float descender;
         float lineh;
+        FT_Face font_;
+        // Backs 'data' when the font was mapped from a file, outlives the face.
+        std::unique_ptr<FONSmappedFile> mapping;
+
+    private:
+        struct FONSftSize {
+            FT_UInt pixels;
+            FT_Size size;
+            unsigned int lastUse;
+        };
+        FONSftSize sizes_[FONS_MAX_FT_SIZES];
+        int nsizes_;
+        FT_UInt activeSize_;
+        unsigned int sizeClock_;
+
+        static constexpr int KERN_ASCII_COUNT = 95;
+        bool hasKerning_;
+        // ASCII slot of a glyph index, or -1.
+        std::vector<signed char> kernSlots_;
+        std::vector<short> kernAscii_;
+        FONShashMap<int> kernPairs_;
+
+        uint64_t dataHash_;
+        // Glyph indices of this face alone, fallbacks are per context.
+        FONScmapCache cmap_;
+        // Keyed by glyph index and size.
+        FONShashMap<FONSglyphMetrics> metrics_;
+    };
+
+    // A font as seen by one context: a shared face, the fallback chain and
+    // the glyphs this context has placed in its atlas.
+    struct FONSfont
+    {
+        FONSfont() :
+            name{},
+            face{},
+            glyphs{nullptr},
+            cglyphs{0},
+            nglyphs{0},
+            lut{FONS_HASH_LUT_SIZE},
+            metrics{FONS_HASH_LUT_SIZE},
+            fallbacks{},
+            nfallbacks{0}
+        {
+        }
+
+        ~FONSfont()
+        {
+            if (glyphs) free(glyphs);
+        }
+
+        FONSglyph* allocGlyph()
+        {
+            if (nglyphs + 1 > cglyphs)
+            {
+                cglyphs = cglyphs == 0 ? 8 : cglyphs * 2;
+                glyphs = (FONSglyph*)realloc(glyphs, sizeof(FONSglyph) * cglyphs);
+                if (glyphs == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+            nglyphs++;
+            return &glyphs[nglyphs-1];
+        }
+        void removeGlyph(int i)
+        {
+            // Swap the last glyph into the hole so the array stays dense.
+            lut.erase(FONSglyph::key(glyphs[i].codepoint, glyphs[i].size, glyphs[i].blur));
+            if (i != nglyphs-1)
+            {
+                glyphs[i] = glyphs[nglyphs-1];
+                lut.insert(FONSglyph::key(glyphs[i].codepoint, glyphs[i].size, glyphs[i].blur), i);
+            }
+            nglyphs--;
+        }
+
+        char name[64];
+        std::shared_ptr<FONSface> face;
         FONSglyph* glyphs;
         int cglyphs;
         int nglyphs;
-        int lut[FONS_HASH_LUT_SIZE];
+        // Glyph index lookup keyed by FONSglyph::key().
+        FONShashMap<int> lut;
+        // Measured glyphs keyed by FONSglyph::key() with zero blur.
+        FONShashMap<FONSglyphMetrics> metrics;
+        // Resolved glyph indices over this font and its fallbacks.
+        FONScmapCache cmap;
         int fallbacks[FONS_MAX_FALLBACKS];
         int nfallbacks;
-        FT_Face font_;
     };
 
+    // Safe to call again, every context and registry shares the library.
     static bool initFreetype()
     {
+        if (ftLibrary != nullptr) return true;
         FT_Error ftError;
         ftError = FT_Init_FreeType(&ftLibrary);
         return ftError == 0;
@@ -222,6 +757,7 @@ namespace fontstash {
                     iblur;
         float       x, y, nextx, nexty, scale, spacing;
         int         prevGlyphIndex;
+        int         prevFallback;
         unsigned int utf8state;
         unsigned int codepoint;
         FONSfont    *font;
@@ -229,6 +765,47 @@ namespace fontstash {
         const char  *next;
         const char  *end;
     };
+
+    // Glyphs to create ahead of time, see FONScontext::prewarm(). Every
+    // codepoint is created at every size and blur.
+    struct FONSprewarm {
+        struct Range {
+            unsigned int first, last;   // Inclusive.
+        };
+        int font = INVALID;
+        std::vector<float> sizes;
+        std::vector<float> blurs;       // Empty means no blur.
+        std::vector<Range> ranges;
+        const char* sample = nullptr;   // Optional UTF-8 text.
+    };
+
+    // Text laid out once by FONScontext::buildTextBlob() and drawn with
+    // drawTextBlob() at any position, without decoding, glyph lookup or
+    // kerning. The blob keeps the style it was built with and is rebuilt
+    // when drawn after the atlas generation changed, see
+    // FONScontext::atlasGeneration(). A blob belongs to the context that
+    // built it.
+    struct FONStextBlob {
+        struct Glyph {
+            float kern;             // Pen move before the glyph, kerning and spacing.
+            float advance;          // Pen move after the glyph.
+            float x0, y0, x1, y1;   // Quad relative to the pen.
+            float s0, t0, s1, t1;
+            int slot;               // Index in the glyph table of the font.
+            int page;
+        };
+        std::string text;
+        int font = INVALID;
+        short isize = 0, iblur = 0;
+        float spacing = 0.0f;
+        int align = 0;
+        unsigned int color = 0;
+        float dy = 0.0f;                // Vertical alignment offset.
+        float advance = 0.0f;
+        std::vector<Glyph> glyphs;
+        unsigned int generation = 0;
+        bool complete = false;          // False if glyphs were missing from the atlas.
+    };
 }
 
 #include "fontstash_impl.hpp"
@@ -16,14 +16,21 @@
 // 3. This notice may not be removed or altered from any source distribution.
 //
 #pragma once
+#include <algorithm>
+#include <climits>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <stdexcept>
 #include "fontstash/fs_util.hpp"
 #include "fontstash/fs_utf8.hpp"
 #include "fontstash/fs_atlas.hpp"
 #include "fontstash/fs_blur.hpp"
+#include "fontstash/fs_dirty.hpp"
+#include "fontstash/fs_layout.hpp"
+#include "fontstash/fs_raster.hpp"
 
 namespace fontstash {
     using font_ptr = std::unique_ptr<FONSfont>;
@@ -36,6 +43,10 @@ namespace fontstash {
     	unsigned int color;
     	float blur;
     	float spacing;
+    	// Rect x0,y0,x1,y1 that text is cut to when 'clipping' is set, in the
+    	// coordinates text is drawn in.
+    	float clip[4];
+    	bool clipping;
         void clear()
         {
             size = 12.0f;
@@ -44,15 +55,150 @@ namespace fontstash {
             blur = 0;
             spacing = 0;
             align = FONS_ALIGN_LEFT | FONS_ALIGN_BASELINE;
+            clipping = false;
         }
     };
 
 
+    // Faces shared between contexts, see FONScontext::setFontRegistry().
+    // Adding a font that is already loaded returns the loaded face, so memory
+    // grows with the number of distinct fonts rather than contexts times
+    // fonts. The registry only holds weak references, a face is released
+    // once no context uses it any more. Faces are not thread safe, contexts
+    // sharing a registry must not be used concurrently.
+    struct FONSfontRegistry {
+        FONSfontRegistry()
+        {
+            if(!initFreetype())
+            {
+                throw std::runtime_error("Failed to initialise Freetype");
+            }
+        }
+
+        // Faces of files are looked up by path as given.
+        std::shared_ptr<FONSface> addFont(const char* path)
+        {
+            for(Entry& e : entries_)
+            {
+                if(e.path == path)
+                {
+                    if(std::shared_ptr<FONSface> face = e.face.lock()) return face;
+                }
+            }
+            std::shared_ptr<FONSface> face = std::make_shared<FONSface>();
+            if(!face->loadFile(path)) return nullptr;
+            remember(Entry{path, nullptr, face});
+            return face;
+        }
+
+        // Faces of memory fonts are looked up by their data pointer. Adding
+        // the same data again with 'freeData' keeps the single owner.
+        std::shared_ptr<FONSface> addFontMem(unsigned char* data, int dataSize, int freeData)
+        {
+            for(Entry& e : entries_)
+            {
+                if(e.data == data)
+                {
+                    std::shared_ptr<FONSface> face = e.face.lock();
+                    if(face != nullptr && face->dataSize == dataSize) return face;
+                }
+            }
+            std::shared_ptr<FONSface> face = std::make_shared<FONSface>();
+            if(!face->load(data, dataSize, freeData)) return nullptr;
+            remember(Entry{std::string(), data, face});
+            return face;
+        }
+
+        // Number of faces currently alive.
+        int size() const
+        {
+            int n = 0;
+            for(const Entry& e : entries_)
+                n += e.face.expired() ? 0 : 1;
+            return n;
+        }
+
+    private:
+        struct Entry {
+            std::string path;
+            const unsigned char* data;
+            std::weak_ptr<FONSface> face;
+        };
+
+        void remember(Entry entry)
+        {
+            // Reuse a slot of a released face.
+            for(Entry& e : entries_)
+            {
+                if(e.face.expired())
+                {
+                    e = std::move(entry);
+                    return;
+                }
+            }
+            entries_.push_back(std::move(entry));
+        }
+
+        std::vector<Entry> entries_;
+    };
+
+
+    // A single atlas texture. Every page has its own packer, CPU copy of the
+    // texture and dirty region, so capacity grows by adding pages instead of
+    // copying the texture into a larger one.
+    struct FONSpage {
+        FONSpage(int w, int h, bool freeable) :
+            atlas{new FONSatlas(w, h, FONS_INIT_ATLAS_NODES, freeable)},
+            texData(w * h, 0)
+        {
+        }
+
+        void resetDirty()
+        {
+            dirtyRects.clear();
+        }
+
+        void markDirty(int x0, int y0, int x1, int y1)
+        {
+            dirtyRects.add(x0, y0, x1, y1);
+        }
+
+        bool dirty() const
+        {
+            return !dirtyRects.empty();
+        }
+
+        std::unique_ptr<FONSatlas> atlas;
+        std::vector<unsigned char> texData;
+        FONSdirtyRects dirtyRects;
+    };
+
+    // Draws of one atlas page collected with FONS_DEFER_DRAWS. The arrays
+    // only grow, so steady frames do not allocate.
+    struct FONSbatch {
+        std::vector<float> verts;
+        std::vector<float> tcoords;
+        std::vector<unsigned int> colors;
+        std::vector<FONSinstance> instances;
+        int nverts = 0;
+        int ninstances = 0;
+    };
+
     struct FONScontext {
         FONScontext(FONSparams *p) :
             params{nullptr},
+            drawPage{0},
             nverts{0},
+            sink{nullptr},
+            sinkCapacity{0},
+            sinkRequest{FONS_VERTEX_COUNT},
+            ninstances{0},
+            arena{},
+            vertexLimit{FONS_MAX_VERTEX_COUNT},
+            stats{},
+            atlasGeneration_{0},
             nstates{0},
+            frame{0},
             handleError{nullptr},
             errorUptr{nullptr}
         {
@@ -75,24 +221,21 @@ namespace fontstash {
                throw std::runtime_error("Failed to initialise rendering backend");
             }
 
-            atlas.reset(new FONSatlas(params->width, params->height, FONS_INIT_ATLAS_NODES));
-
             // Allocate space for fonts.
-            fonts.resize(FONS_INIT_FONTS);
+            fonts.reserve(FONS_INIT_FONTS);
+
+            // Vertex storage, grows on demand.
+            buffer.verts.resize(FONS_VERTEX_COUNT*2);
+            buffer.tcoords.resize(FONS_VERTEX_COUNT*2);
+            buffer.colors.resize(FONS_VERTEX_COUNT);
+            buffer.instances.resize(FONS_VERTEX_COUNT);
+            setVertexLimit(FONS_MAX_VERTEX_COUNT);
+            bindStorage();
 
             // Create texture for the cache.
             itw_ = 1.0f/params->width;
             ith_ = 1.0f/params->height;
-            texData = (unsigned char*)std::calloc(params->width * params->height, sizeof(unsigned char));
-            if(texData == nullptr)
-            {
-                throw std::bad_alloc();
-            }
-
-            dirtyRect[0] = params->width;
-            dirtyRect[1] = params->height;
-            dirtyRect[2] = 0;
-            dirtyRect[3] = 0;
+            pages.emplace_back(params->width, params->height, (params->flags & FONS_EVICT_LRU) != 0);
 
             // Add white rect at 0,0 for debug drawing.
             addWhiteRect(2, 2);
@@ -103,11 +246,6 @@ namespace fontstash {
 
         ~FONScontext()
         {
-            if(texData)
-            {
-                free(texData);
-            }
-
             if(scratch)
             {
                 free(scratch);
@@ -123,10 +261,46 @@ namespace fontstash {
         int fonsExpandAtlas(int width, int height);
         // Resets the whole stash.
         int fonsResetAtlas(int width, int height);
+        // Writes the atlas pages and glyph tables to 'path'.
+        int saveCache(const char* path);
+        // Replaces the atlas with one written by saveCache(). Load the fonts
+        // and their fallbacks first, glyphs are matched to fonts by a hash of
+        // the font data. Returns 0 and leaves the atlas alone if the file is
+        // missing or was written with a different atlas size, flags, cache
+        // format or FreeType version. Glyphs of fonts that are not loaded are
+        // dropped.
+        int loadCache(const char* path);
+        // Marks the end of a frame. With FONS_DEFER_DRAWS, draws the text of
+        // the frame, one batch per atlas page. With FONS_EVICT_LRU, glyphs not
+        // used since the last call can be evicted to make room for new ones.
+        void endFrame();
+        // Creates the glyphs of a prewarm request ahead of use and uploads them
+        // at once. Stops when the atlas is full, glyphs that did not fit are
+        // created on first use as usual. Returns the number of glyphs added.
+        int prewarm(const FONSprewarm& req);
+        // Rasterizes glyphs missing from the atlas on 'n' threads, the calling
+        // thread included. 1 (the default) renders serially as glyphs are met.
+        void setRasterThreads(int n);
+        // Batches grow until they hold 'maxVertices' vertices (or as many
+        // instances), then they are flushed. Defaults to FONS_MAX_VERTEX_COUNT.
+        // Vertex batches never exceed 65536 vertices with FONS_INDEXED_QUADS.
+        void setVertexLimit(int maxVertices);
+        // Writes immediate mode batches to caller storage instead of growing
+        // internal arrays, a full arena flushes the batch. Pass null to go
+        // back to internal storage. Returns 0 if the arena holds fewer than
+        // 12 vertices. Deferred batches always use internal storage.
+        int setVertexArena(const FONSvertexArena* arena);
+        FONSvertexStats vertexStats() const { return stats; }
+        void resetVertexStats() { stats = FONSvertexStats{}; }
 
         // Add fonts
         int addFont(const char* name, const char* path);
         int addFontMem(const char* name, unsigned char* data, int ndata, int freeData);
+        // Adds an already loaded face, for example one shared with another context.
+        int addFace(const char* name, std::shared_ptr<FONSface> face);
+        // Makes later addFont() and addFontMem() calls share faces with every
+        // other context using 'fontRegistry'.
+        void setFontRegistry(std::shared_ptr<FONSfontRegistry> fontRegistry);
         int getFontByName(const char* name);
 
         // State handling
@@ -141,9 +315,33 @@ namespace fontstash {
         void setBlur(float blur);
         void setAlign(int align);
         void setFont(int font);
+        // Cuts drawn text to the rect (x0,y0)-(x1,y1). Glyphs outside it are
+        // skipped before they are looked up in the atlas, glyphs across its
+        // edges are trimmed with their texture coordinates, instance records
+        // to whole pixels. Text is taken to run left to right, drawing stops
+        // once the pen is past the right edge, so the x returned then falls
+        // short of the end of the text.
+        void setClip(float x0, float y0, float x1, float y1);
+        void resetClip();
 
         // Draw text
         float fonsDrawText(float x, float y, const char* string, const char* end);
+        // Lays out 'string' with the current state into 'blob' and returns its
+        // advance. Drawn at (x,y), it matches fonsDrawText(x, y, string, end).
+        float buildTextBlob(FONStextBlob* blob, const char* string, const char* end);
+        // Draws 'blob' at (x,y), laying it out again first if the atlas has
+        // changed since. Returns the x after the text like fonsDrawText. The
+        // current clip rect applies.
+        float drawTextBlob(FONStextBlob* blob, float x, float y);
+        // Changes whenever placed glyphs move or go away: when glyphs are
+        // evicted and when the atlas is reset, expanded or loaded.
+        unsigned int atlasGeneration() const { return atlasGeneration_; }
+        // Makes fonsDrawText keep the layout of the last 'maxEntries' distinct
+        // strings and styles and draw repeated ones from it. 0 (the default)
+        // turns the cache off.
+        void setLayoutCache(int maxEntries);
+        FONSlayoutStats layoutCacheStats() const;
+        void resetLayoutCacheStats();
 
         // Measure text
         float textBounds(float x, float y, const char* string, const char* end, float* bounds);
@@ -155,8 +353,10 @@ namespace fontstash {
         int fonsTextIterNext(FONStextIter* iter, struct FONSquad* quad);
 
         // Pull texture changes
-        const unsigned char* fonsGetTextureData(int* width, int* height);
-        int fonsValidateTexture(int* dirty);
+        const unsigned char* fonsGetTextureData(int* width, int* height, int page = 0);
+        int fonsValidateTexture(int* dirty, int page = 0);
+        // Number of atlas pages, all pages have the size of the atlas.
+        int fonsGetPageCount() const;
 
         // Draws the stash texture for debugging
         void drawDebug(float x, float y);
@@ -164,68 +364,162 @@ namespace fontstash {
         std::unique_ptr<FONSparams>  params;
     	float          itw_,
                         ith_;
-    	unsigned char* texData;
-    	int            dirtyRect[4];
+        std::vector<FONSpage> pages;
+        int             drawPage;
         std::vector<font_ptr> fonts;
-        std::unique_ptr<FONSatlas> atlas;
-    	float           verts[FONS_VERTEX_COUNT*2];
-    	float           tcoords[FONS_VERTEX_COUNT*2];
-    	unsigned int    colors[FONS_VERTEX_COUNT];
     	int             nverts;
+    	FONSvertex      *sink;          // Backend buffer of the current batch, or null.
+    	int             sinkCapacity;
+    	int             sinkRequest;    // Vertices asked of renderMapVertices(), grows like 'buffer'.
+    	int             ninstances;
+    	FONSbatch       buffer;         // Immediate mode storage.
+    	FONSvertexArena arena;
+    	// Where vertex() and instances are written: 'buffer', the arena or the
+    	// frame batch of 'drawPage' with FONS_DEFER_DRAWS.
+    	float           *vdst, *tdst;
+    	unsigned int    *cdst;
+    	FONSinstance    *idst;
+    	int             vcapacity, icapacity;
+    	int             vertexLimit;
+    	FONSvertexStats stats;
+    	unsigned int    atlasGeneration_;
+    	std::vector<FONSbatch> frameBatches;
     	unsigned char   *scratch;
     	int             nscratch;
     	FONSstate       states[FONS_MAX_STATES];
     	int             nstates;
+    	unsigned int    frame;
     	void            (*handleError)(void* uptr, int error, int val);
     	void            *errorUptr;
-
-        void        getQuad(FONSfont *font, int prevGlyphIndex, FONSglyph* glyph, float scale, float spacing, float* x, float* y, FONSquad* q);
-
-        void        addWhiteRect(int w, int h);
+    	std::shared_ptr<FONSfontRegistry> registry;
+    	std::unique_ptr<FONSrasterPool> rasterPool;
+    	std::unique_ptr<FONSlayoutCache> layoutCache;
+    	std::vector<FONSrasterJob> rasterJobs;
+    	// Glyphs by last use for FONS_EVICT_LRU, a min-heap. Entries are only
+    	// updated when they reach the top, so the recorded use may be older
+    	// than the glyph's.
+    	struct LruEntry {
+    		unsigned int lastUse;
+    		FONSfont *font;
+    		uint64_t key;
+
+    		// Ties go by key, so the order does not depend on the history of the heap.
+    		static bool newer(const LruEntry& a, const LruEntry& b)
+    		{
+    			return a.lastUse != b.lastUse ? a.lastUse > b.lastUse : a.key > b.key;
+    		}
+    	};
+    	std::vector<LruEntry> lru_;
+
+        void        getQuad(FONSfont *font, int prevGlyphIndex, int prevFallback, FONSglyph* glyph, float scale, float spacing, float* x, float* y, FONSquad* q);
+        // Like getQuad() but packs the glyph into an instance record. Returns
+        // false if the quad lies outside the range of its coordinates.
+        bool        getInstance(FONSfont *font, int prevGlyphIndex, int prevFallback, FONSglyph* glyph, float scale, float spacing, float* x, float* y, unsigned int color, FONSinstance* inst);
+        // Like getQuad() but from measured metrics, positions only.
+        void        getMetricsQuad(FONSfont *font, int prevGlyphIndex, int prevFallback, const FONSglyphMetrics* m, short isize, short iblur, float scale, float spacing, float* x, float* y, FONSquad* q);
+
+        void        addWhiteRect(int w, int h, int page = 0);
+        int         allocGlyphRect(int w, int h, int* gx, int* gy, int* page);
+        int         addPage();
+        int         evictGlyphs(int w, int h, int* gx, int* gy, int* page);
+        // Creates the glyphs of 'codepoints' for prewarm() and empties it.
+        // Returns false once the atlas is full.
+        bool        prewarmChunk(FONSfont *font, const FONSprewarm& req, std::vector<unsigned int>& codepoints, int* added);
+        // Queues a new glyph for eviction with FONS_EVICT_LRU.
+        void        trackGlyph(FONSfont *font, const FONSglyph& g);
         int         addFallbackFont(int base, int fallback);
+        // Reserves atlas space for the glyphs of 'str' that are not cached yet
+        // and renders them as one batch on the raster pool.
+        void        rasterizeMissing(FONSfont *font, const char* str, const char* end, short isize, short iblur);
+        void        rasterizeJobs();
         void        flush();
+        // Makes room for 'n' more vertices sampling 'page', flushing the
+        // current batch if it is full or samples another page.
+        void        reserveVertices(int n, int page);
+        // Same for 'n' more instances with FONS_INSTANCED_QUADS.
+        void        reserveInstances(int n, int page);
+        // With FONS_DEFER_DRAWS, switches to the frame batch of 'page' and
+        // grows it to take 'nverts' more vertices and 'ninst' more instances.
+        void        reserveBatch(int page, int nverts, int ninst);
+        void        submitBatches();
+        // Grows 'b' to hold 'nv' vertices and 'ni' instances, returns false if
+        // that is over the vertex limit.
+        bool        growBatch(FONSbatch& b, int nv, int ni);
+        // Grows immediate mode storage for 'nv' more vertices and 'ni' more
+        // instances, returns false if it cannot.
+        bool        growStorage(int nv, int ni);
+        void        bindStorage();
+        // Lays out the text of 'blob' again with its own style.
+        void        layoutBlob(FONStextBlob* blob);
+        float       drawBlob(FONStextBlob* blob, float x, float y, unsigned int color);
+        // textBounds() with an explicit style.
+        float       measureText(FONSfont *font, short isize, short iblur, float spacing, int align,
+                                float x, float y, const char* str, const char* end, float* bounds);
+        // fonsDrawText through the layout cache.
+        float       drawCached(float x, float y, const char* str, const char* end);
         FONSstate*  getState()
         {
             return &states[nstates-1];
         }
-        void freeFont(FONSfont *font)
-        {
-            if(font == nullptr) return;
-            if(font->glyphs) free(font->glyphs);
-            if(font->freeData && font->data) free(font->data);
-            free(font);
-        }
-
         int allocFont()
         {
-            FONSfont *font = nullptr;
-            font = reinterpret_cast<FONSfont*>(std::calloc(1, sizeof(FONSfont)));
-            if(font == nullptr)
-            {
-                freeFont(font);
-                return INVALID;
-            }
-
+            font_ptr font{new FONSfont()};
             font->glyphs = reinterpret_cast<FONSglyph*>(std::calloc(FONS_INIT_GLYPHS, sizeof(FONSglyph)));
             if(font->glyphs == nullptr)
             {
-                freeFont(font);
                 return INVALID;
             }
             font->cglyphs = FONS_INIT_GLYPHS;
             font->nglyphs = 0;
 
-            fonts.emplace_back(font);
+            fonts.push_back(std::move(font));
             return fonts.size() - 1;
         }
 
+        // Vertices one quad takes in the vertex buffer.
+        int quadVertices() const
+        {
+            return (params->flags & FONS_INDEXED_QUADS) ? 4 : 6;
+        }
+
+        // Emits the axis-aligned quad (x0,y0)-(x1,y1), as 4 indexed corners
+        // or as two triangles.
+        void emitQuad(float x0, float y0, float x1, float y1, float s0, float t0, float s1, float t1, unsigned int c)
+        {
+            if(params->flags & FONS_INDEXED_QUADS)
+            {
+                vertex(x0, y0, s0, t0, c);
+                vertex(x1, y0, s1, t0, c);
+                vertex(x1, y1, s1, t1, c);
+                vertex(x0, y1, s0, t1, c);
+                return;
+            }
+            vertex(x0, y0, s0, t0, c);
+            vertex(x1, y1, s1, t1, c);
+            vertex(x1, y0, s1, t0, c);
+
+            vertex(x0, y0, s0, t0, c);
+            vertex(x0, y1, s0, t1, c);
+            vertex(x1, y1, s1, t1, c);
+        }
+
         void vertex(float x, float y, float s, float t, unsigned int c)
         {
-            verts[nverts*2+0] = x;
-            verts[nverts*2+1] = y;
-            tcoords[nverts*2+0] = s;
-            tcoords[nverts*2+1] = t;
-            colors[nverts] = c;
+            if(sink != nullptr)
+            {
+                FONSvertex& v = sink[nverts++];
+                v.x = x;
+                v.y = y;
+                v.s = s;
+                v.t = t;
+                v.c = c;
+                return;
+            }
+            vdst[nverts*2+0] = x;
+            vdst[nverts*2+1] = y;
+            tdst[nverts*2+0] = s;
+            tdst[nverts*2+1] = t;
+            cdst[nverts] = c;
             nverts++;
         }
     };
@@ -264,15 +558,16 @@ namespace fontstash {
     #endif // STB_TRUETYPE_IMPLEMENTATION
 
 
-    void FONScontext::addWhiteRect(int w, int h)
+    void FONScontext::addWhiteRect(int w, int h, int pageIndex)
     {
         int x, y, gx, gy;
-        if(atlas->addRect(w, h, &gx, &gy) == 0)
+        FONSpage& page = pages[pageIndex];
+        if(page.atlas->addRect(w, h, &gx, &gy) == 0)
         {
             return;
         }
         // Rasterize
-        unsigned char *dst = &texData[gx + gy * params->width];
+        unsigned char *dst = &page.texData[gx + gy * params->width];
         for (y = 0; y < h; y++)
         {
             for (x = 0; x < w; x++)
@@ -282,18 +577,112 @@ namespace fontstash {
             dst += params->width;
         }
 
-        dirtyRect[0] = mini(dirtyRect[0], gx);
-        dirtyRect[1] = mini(dirtyRect[1], gy);
-        dirtyRect[2] = maxi(dirtyRect[2], gx+w);
-        dirtyRect[3] = maxi(dirtyRect[3], gy+h);
+        page.markDirty(gx, gy, gx+w, gy+h);
+    }
+
+    int FONScontext::addPage()
+    {
+    	int idx = (int)pages.size();
+    	if(idx >= FONS_MAX_PAGES || params->renderAddPage(idx) == 0)
+        {
+    		return INVALID;
+        }
+    	pages.emplace_back(params->width, params->height, (params->flags & FONS_EVICT_LRU) != 0);
+    	// Every page gets a white rect, debug drawing samples it.
+    	addWhiteRect(2, 2, idx);
+    	return idx;
+    }
+
+    int FONScontext::allocGlyphRect(int w, int h, int* gx, int* gy, int* page)
+    {
+    	// Newest page first, it is the one most likely to have room.
+    	for(int i = (int)pages.size() - 1; i >= 0; --i)
+        {
+    		if(pages[i].atlas->addRect(w, h, gx, gy))
+            {
+    			*page = i;
+    			return 1;
+    		}
+    	}
+    	// Spill to a new page if the backend supports it.
+    	int idx = addPage();
+    	if(idx != INVALID && pages[idx].atlas->addRect(w, h, gx, gy))
+        {
+    		*page = idx;
+    		return 1;
+    	}
+    	// Make room by dropping glyphs that were not used this frame.
+    	if(params->flags & FONS_EVICT_LRU)
+        {
+    		return evictGlyphs(w, h, gx, gy, page);
+        }
+    	return 0;
+    }
+
+
+    void FONScontext::trackGlyph(FONSfont *font, const FONSglyph& g)
+    {
+    	if(!(params->flags & FONS_EVICT_LRU)) return;
+    	lru_.push_back(LruEntry{g.lastUse, font, FONSglyph::key(g.codepoint, g.size, g.blur)});
+    	std::push_heap(lru_.begin(), lru_.end(), LruEntry::newer);
     }
 
+    int FONScontext::evictGlyphs(int w, int h, int* gx, int* gy, int* page)
+    {
+    	// Free the least recently used glyphs until the new rect fits. Heap
+    	// entries are refreshed lazily, the top is the oldest glyph once its
+    	// recorded use matches the glyph's.
+    	while(!lru_.empty())
+        {
+    		std::pop_heap(lru_.begin(), lru_.end(), LruEntry::newer);
+    		LruEntry e = lru_.back();
+    		int* idx = e.font->lut.find(e.key);
+    		if(idx == nullptr)
+            {
+    			lru_.pop_back();
+    			continue;
+    		}
+    		FONSglyph g = e.font->glyphs[*idx];
+    		if(g.lastUse != e.lastUse || g.lastUse == frame)
+            {
+    			lru_.back().lastUse = g.lastUse;
+    			std::push_heap(lru_.begin(), lru_.end(), LruEntry::newer);
+    			// Everything left was used this frame.
+    			if(g.lastUse == frame && lru_.front().lastUse == frame)
+    				return 0;
+    			continue;
+    		}
+    		lru_.pop_back();
+
+    		FONSpage& gpage = pages[g.page];
+    		e.font->removeGlyph(*idx);
+    		gpage.atlas->freeRect(g.x0, g.y0, g.x1 - g.x0, g.y1 - g.y0);
+    		atlasGeneration_++;
+
+    		// Keep free atlas space clear, glyphs do not overwrite their padding.
+    		for(int y = g.y0; y < g.y1; ++y)
+            {
+    			memset(&gpage.texData[g.x0 + y * params->width], 0, g.x1 - g.x0);
+            }
+    		// The backend texture has to lose the old pixels too.
+    		gpage.markDirty(g.x0, g.y0, g.x1, g.y1);
+
+    		if(gpage.atlas->addRect(w, h, gx, gy))
+            {
+    			*page = g.page;
+    			return 1;
+    		}
+    	}
+    	return 0;
+    }
 
     int FONScontext::addFallbackFont(int base, int fallback)
     {
     	FONSfont *baseFont = fonts[base].get();
     	if(baseFont->nfallbacks < FONS_MAX_FALLBACKS) {
     		baseFont->fallbacks[baseFont->nfallbacks++] = fallback;
+    		// Cached misses may resolve in the new fallback.
+    		baseFont->cmap.clear();
     		return 1;
     	}
     	return 0;
@@ -329,6 +718,21 @@ namespace fontstash {
     	getState()->font = font;
     }
 
+    void FONScontext::setClip(float x0, float y0, float x1, float y1)
+    {
+    	FONSstate* state = getState();
+    	state->clip[0] = x0;
+    	state->clip[1] = y0;
+    	state->clip[2] = x1;
+    	state->clip[3] = y1;
+    	state->clipping = true;
+    }
+
+    void FONScontext::resetClip()
+    {
+    	getState()->clipping = false;
+    }
+
     void FONScontext::pushState()
     {
     	if(nstates >= FONS_MAX_STATES)
@@ -394,37 +798,79 @@ namespace fontstash {
     #endif
     }
 
-    int FONScontext::addFont(const char* name, const char* path)
+    inline bool FONSface::loadFile(const char* path)
     {
     	FILE* fp = 0;
-    	int dataSize = 0, readed;
-    	unsigned char* data = nullptr;
+    	int fileSize = 0, readed;
+    	unsigned char* fileData = nullptr;
+
+    	// Map the file read-only, FreeType only pages in the tables it reads
+    	// and the pages are shared with every other user of the file.
+    	std::unique_ptr<FONSmappedFile> file{new FONSmappedFile()};
+    	if(file->open(path) && file->size() <= INT_MAX)
+        {
+    		file->adviseRandom();
+    		// The face never writes to its data.
+    		unsigned char* mapped = const_cast<unsigned char*>(file->data());
+    		mapping = std::move(file);
+    		return load(mapped, (int)mapping->size(), 0);
+    	}
 
     	// Read in the font data.
     	fp = fons__fopen(path, "rb");
     	if(fp == nullptr) goto error;
     	fseek(fp,0,SEEK_END);
-    	dataSize = (int)ftell(fp);
+    	fileSize = (int)ftell(fp);
     	fseek(fp,0,SEEK_SET);
-    	data = (unsigned char*)std::calloc(dataSize, sizeof(unsigned char));
-    	if(data == nullptr) goto error;
-    	readed = fread(data, 1, dataSize, fp);
+    	fileData = (unsigned char*)std::calloc(fileSize, sizeof(unsigned char));
+    	if(fileData == nullptr) goto error;
+    	readed = fread(fileData, 1, fileSize, fp);
     	fclose(fp);
     	fp = 0;
-    	if(readed != dataSize) goto error;
+    	if(readed != fileSize) goto error;
 
-    	return addFontMem(name, data, dataSize, 1);
+    	return load(fileData, fileSize, 1);
 
     error:
-    	if(data) free(data);
+    	if(fileData) free(fileData);
     	if(fp) fclose(fp);
-    	return INVALID;
+    	return false;
+    }
+
+    int FONScontext::addFont(const char* name, const char* path)
+    {
+    	std::shared_ptr<FONSface> face;
+    	if(registry != nullptr)
+        {
+    		face = registry->addFont(path);
+        }
+        else
+        {
+    		face = std::make_shared<FONSface>();
+    		if(!face->loadFile(path)) face.reset();
+    	}
+    	return addFace(name, face);
     }
 
     int FONScontext::addFontMem(const char* name, unsigned char* data, int dataSize, int freeData)
     {
-    	int i, ascent, descent, fh, lineGap;
-    	
+    	std::shared_ptr<FONSface> face;
+    	if(registry != nullptr)
+        {
+    		face = registry->addFontMem(data, dataSize, freeData);
+        }
+        else
+        {
+    		face = std::make_shared<FONSface>();
+    		if(!face->load(data, dataSize, freeData)) face.reset();
+    	}
+    	return addFace(name, face);
+    }
+
+    int FONScontext::addFace(const char* name, std::shared_ptr<FONSface> face)
+    {
+    	if(face == nullptr) return INVALID;
+
     	int idx = allocFont();
     	if(idx == INVALID)
         {
@@ -435,33 +881,7 @@ namespace fontstash {
 
     	strncpy(font->name, name, sizeof(font->name));
     	font->name[sizeof(font->name)-1] = '\0';
-
-    	// Init hash lookup.
-    	for (i = 0; i < FONS_HASH_LUT_SIZE; ++i)
-        {
-    		font->lut[i] = -1;
-        }
-
-    	// Read in the font data.
-    	font->dataSize = dataSize;
-    	font->data = data;
-    	font->freeData = static_cast<unsigned char>(freeData);
-
-    	// Init font
-    	nscratch = 0;
-    	if(!font->loadFont(this, data, dataSize))
-        {
-            freeFont(font);
-            fonts.pop_back();
-            return INVALID;
-        }
-    	// Store normalized line height. The real line height is got
-    	// by multiplying the lineh by font size.
-    	font->getFontVMetrics(&ascent, &descent, &lineGap);
-    	fh = ascent - descent;
-    	font->ascender = (float)ascent / (float)fh;
-    	font->descender = (float)descent / (float)fh;
-    	font->lineh = (float)(fh + lineGap) / (float)fh;
+    	font->face = std::move(face);
 
     	return idx;
     }
@@ -480,15 +900,95 @@ namespace fontstash {
 
 
 
+    static int fons__findGlyphIndex(FONScontext* stash, FONSfont *font, unsigned int codepoint, FONSfont **renderFont,
+    								int* fallback = nullptr)
+    {
+    	int slot = 0;
+    	int g = 0;
+    	if(!font->cmap.find(codepoint, &slot, &g))
+        {
+    		g = font->face->getGlyphIndex(codepoint);
+    		// Try to find the glyph in fallback fonts.
+    		if(g == 0)
+            {
+    			for (int i = 0; i < font->nfallbacks; ++i)
+                {
+    				int fallbackIndex = stash->fonts[font->fallbacks[i]]->face->getGlyphIndex(codepoint);
+    				if(fallbackIndex != 0)
+                    {
+    					slot = i + 1;
+    					g = fallbackIndex;
+    					break;
+    				}
+    			}
+    			// It is possible that we did not find a fallback glyph.
+    			// In that case the glyph index 'g' is 0, and the empty glyph is cached.
+    		}
+    		font->cmap.insert(codepoint, slot, g);
+    	}
+    	*renderFont = slot == 0 ? font : stash->fonts[font->fallbacks[slot - 1]].get();
+    	if(fallback != nullptr) *fallback = slot;
+    	return g;
+    }
+
+    static FONSglyphMetrics* fons__getGlyphMetrics(FONScontext* stash, FONSfont *font, unsigned int codepoint, short isize)
+    {
+    	FONSfont *renderFont = font;
+
+    	if(isize < 2) return nullptr;
+
+    	uint64_t key = FONSglyph::key(codepoint, isize, 0);
+    	if(FONSglyphMetrics* found = font->metrics.find(key))
+        {
+    		return found;
+        }
+
+    	// Faces measure each glyph once for every context sharing them.
+    	int fallback;
+    	int g = fons__findGlyphIndex(stash, font, codepoint, &renderFont, &fallback);
+    	const FONSglyphMetrics* measured = renderFont->face->getGlyphMetrics(g, isize);
+    	if(measured == nullptr) return nullptr;
+    	FONSglyphMetrics m = *measured;
+    	m.fallback = (short)fallback;
+    	font->metrics.insert(key, m);
+    	return font->metrics.find(key);
+    }
+
+    // Registers a glyph placed at (gx,gy) on 'page' in the font's glyph table.
+    static FONSglyph* fons__addGlyph(FONScontext* stash, FONSfont *font, unsigned int codepoint, short isize, short iblur,
+    								 int g, int fallback, int page, int gx, int gy, int gw, int gh, short xadv, int xoff, int yoff)
+    {
+    	FONSglyph* glyph = font->allocGlyph();
+    	glyph->codepoint = codepoint;
+    	glyph->size = isize;
+    	glyph->blur = iblur;
+    	glyph->index = g;
+    	glyph->page = (short)page;
+    	glyph->fallback = (short)fallback;
+    	glyph->x0 = (short)gx;
+    	glyph->y0 = (short)gy;
+    	glyph->x1 = (short)(glyph->x0+gw);
+    	glyph->y1 = (short)(glyph->y0+gh);
+    	glyph->xadv = xadv;
+    	glyph->xoff = (short)xoff;
+    	glyph->yoff = (short)yoff;
+    	glyph->lastUse = stash->frame;
+
+    	// Insert char to hash lookup.
+    	font->lut.insert(FONSglyph::key(codepoint, isize, iblur), font->nglyphs-1);
+    	stash->trackGlyph(font, *glyph);
+    	return glyph;
+    }
+
     static FONSglyph* fons__getGlyph(FONScontext* stash, FONSfont *font, unsigned int codepoint,
     								 short isize, short iblur)
     {
-    	int i, g, advance, lsb, x0, y0, x1, y1, gw, gh, gx, gy, x, y;
+    	int g, fallback, advance, lsb, x0, y0, x1, y1, gw, gh, gx, gy, x, y;
     	float scale;
     	FONSglyph* glyph = nullptr;
-    	unsigned int h;
+    	uint64_t key;
     	float size = isize/10.0f;
-    	int pad, added;
+    	int pad, added, page = 0;
     	unsigned char* bdst;
     	unsigned char* dst;
     	FONSfont *renderFont = font;
@@ -501,74 +1001,41 @@ namespace fontstash {
     	stash->nscratch = 0;
 
     	// Find code point and size.
-    	h = hashint(codepoint) & (FONS_HASH_LUT_SIZE-1);
-    	i = font->lut[h];
-    	while (i != -1) {
-    		if(font->glyphs[i].codepoint == codepoint && font->glyphs[i].size == isize && font->glyphs[i].blur == iblur)
-            {
-    			return &font->glyphs[i];
-    		}
-            i = font->glyphs[i].next;
-    	}
+    	key = FONSglyph::key(codepoint, isize, iblur);
+    	if(int* found = font->lut.find(key))
+        {
+    		glyph = &font->glyphs[*found];
+    		glyph->lastUse = stash->frame;
+    		return glyph;
+        }
 
     	// Could not find glyph, create it.
-    	g = font->getGlyphIndex(codepoint);
-    	// Try to find the glyph in fallback fonts.
-    	if(g == 0)
-        {
-    		for (i = 0; i < font->nfallbacks; ++i)
-            {
-    			FONSfont *fallbackFont = stash->fonts[font->fallbacks[i]].get();
-    			int fallbackIndex = fallbackFont->getGlyphIndex(codepoint);
-    			if(fallbackIndex != 0)
-                {
-    				g = fallbackIndex;
-    				renderFont = fallbackFont;
-    				break;
-    			}
-    		}
-    		// It is possible that we did not find a fallback glyph.
-    		// In that case the glyph index 'g' is 0, and we'll proceed below and cache empty glyph.
-    	}
-    	scale = renderFont->getPixelHeightScale(size);
-    	renderFont->buildGlyphBitmap(g, size, scale, &advance, &lsb, &x0, &y0, &x1, &y1);
+    	g = fons__findGlyphIndex(stash, font, codepoint, &renderFont, &fallback);
+    	scale = renderFont->face->getPixelHeightScale(size);
+    	if(!renderFont->face->buildGlyphBitmap(g, size, scale, &advance, &lsb, &x0, &y0, &x1, &y1))
+    		return nullptr;
     	gw = x1-x0 + pad*2;
     	gh = y1-y0 + pad*2;
 
-    	// Find free spot for the rect in the atlas
-    	added = stash->atlas->addRect(gw, gh, &gx, &gy);
+    	// Find free spot for the rect in the atlas pages
+    	added = stash->allocGlyphRect(gw, gh, &gx, &gy, &page);
     	if(added == 0 && stash->handleError != nullptr) {
     		// Atlas is full, let the user to resize the atlas (or not), and try again.
     		stash->handleError(stash->errorUptr, FONS_ATLAS_FULL, 0);
-    		added = stash->atlas->addRect(gw, gh, &gx, &gy);
+    		added = stash->allocGlyphRect(gw, gh, &gx, &gy, &page);
     	}
     	if(added == 0) return nullptr;
+    	unsigned char* texData = stash->pages[page].texData.data();
 
-    	// Init glyph.
-    	glyph = font->allocGlyph();
-    	glyph->codepoint = codepoint;
-    	glyph->size = isize;
-    	glyph->blur = iblur;
-    	glyph->index = g;
-    	glyph->x0 = (short)gx;
-    	glyph->y0 = (short)gy;
-    	glyph->x1 = (short)(glyph->x0+gw);
-    	glyph->y1 = (short)(glyph->y0+gh);
-    	glyph->xadv = (short)(scale * advance * 10.0f);
-    	glyph->xoff = (short)(x0 - pad);
-    	glyph->yoff = (short)(y0 - pad);
-    	glyph->next = 0;
-
-    	// Insert char to hash lookup.
-    	glyph->next = font->lut[h];
-    	font->lut[h] = font->nglyphs-1;
+    	glyph = fons__addGlyph(stash, font, codepoint, isize, iblur, g, fallback, page, gx, gy, gw, gh,
+    						   (short)(scale * advance * 10.0f), x0 - pad, y0 - pad);
 
     	// Rasterize
-    	dst = &stash->texData[(glyph->x0+pad) + (glyph->y0+pad) * stash->params->width];
-    	renderFont->renderGlyphBitmap(dst, gw-pad*2,gh-pad*2, stash->params->width, scale,scale, g);
+    	dst = &texData[(glyph->x0+pad) + (glyph->y0+pad) * stash->params->width];
+    	renderFont->face->renderGlyphBitmap(dst, gw-pad*2,gh-pad*2, stash->params->width, scale,scale, g);
 
     	// Make sure there is one pixel empty border.
-    	dst = &stash->texData[glyph->x0 + glyph->y0 * stash->params->width];
+    	dst = &texData[glyph->x0 + glyph->y0 * stash->params->width];
     	for (y = 0; y < gh; y++) {
     		dst[y*stash->params->width] = 0;
     		dst[gw-1 + y*stash->params->width] = 0;
@@ -579,7 +1046,7 @@ namespace fontstash {
     	}
 
     	// Debug code to color the glyph background
-    /*	unsigned char* fdst = &stash->texData[glyph->x0 + glyph->y0 * stash->params->width];
+    /*	unsigned char* fdst = &texData[glyph->x0 + glyph->y0 * stash->params->width];
     	for (y = 0; y < gh; y++) {
     		for (x = 0; x < gw; x++) {
     			int a = (int)fdst[x+y*stash->params->width] + 20;
@@ -592,53 +1059,307 @@ namespace fontstash {
     	if(iblur > 0)
         {
     		stash->nscratch = 0;
-    		bdst = &stash->texData[glyph->x0 + glyph->y0 * stash->params->width];
+    		bdst = &texData[glyph->x0 + glyph->y0 * stash->params->width];
             fontstash::blur(bdst, gw,gh, stash->params->width, iblur);
     	}
 
-    	stash->dirtyRect[0] = mini(stash->dirtyRect[0], glyph->x0);
-    	stash->dirtyRect[1] = mini(stash->dirtyRect[1], glyph->y0);
-    	stash->dirtyRect[2] = maxi(stash->dirtyRect[2], glyph->x1);
-    	stash->dirtyRect[3] = maxi(stash->dirtyRect[3], glyph->y1);
+    	stash->pages[page].markDirty(glyph->x0, glyph->y0, glyph->x1, glyph->y1);
 
     	return glyph;
     }
 
-    void FONScontext::getQuad(FONSfont *font, int prevGlyphIndex, FONSglyph* glyph, float scale, float spacing, float* x, float* y, FONSquad* q)
+    // Like fons__getGlyph() for a missing glyph, but sizes the rect from the
+    // metrics cache and leaves rendering to the raster pool. Returns 0 when
+    // the atlas has no room, the serial path then reports it to the user.
+    static int fons__reserveGlyph(FONScontext* stash, FONSfont *font, unsigned int codepoint,
+    							  short isize, short iblur, FONSrasterJob* job)
     {
-    	float rx,ry,xoff,yoff,x0,y0,x1,y1;
-
-    	if(prevGlyphIndex != -1) {
-    		float adv = font->getGlyphKernAdvance(prevGlyphIndex, glyph->index) * scale;
-    		*x += (int)(adv + spacing + 0.5f);
-    	}
+    	int gx, gy, page = 0;
+    	int pad = iblur+2;
+    	FONSfont *renderFont = font;
 
-    	// Each glyph has 2px border to allow good interpolation,
-    	// one pixel to prevent leaking, and one to allow good interpolation for rendering.
-    	// Inset the texture region by one pixel for correct interpolation.
-    	xoff = (short)(glyph->xoff+1);
-    	yoff = (short)(glyph->yoff+1);
-    	x0 = (float)(glyph->x0+1);
-    	y0 = (float)(glyph->y0+1);
-    	x1 = (float)(glyph->x1-1);
-    	y1 = (float)(glyph->y1-1);
+    	FONSglyphMetrics* m = fons__getGlyphMetrics(stash, font, codepoint, isize);
+    	if(m == nullptr) return 0;
+    	int gw = m->x1-m->x0 + pad*2;
+    	int gh = m->y1-m->y0 + pad*2;
+    	if(stash->allocGlyphRect(gw, gh, &gx, &gy, &page) == 0) return 0;
+
+    	fons__addGlyph(stash, font, codepoint, isize, iblur, m->index, m->fallback, page, gx, gy, gw, gh,
+    				   m->xadv, m->x0 - pad, m->y0 - pad);
+    	stash->pages[page].markDirty(gx, gy, gx+gw, gy+gh);
+
+    	fons__findGlyphIndex(stash, font, codepoint, &renderFont);
+    	job->face = renderFont->face.get();
+    	job->index = m->index;
+    	job->pixels = renderFont->face->getPixelSize(isize/10.0f);
+    	job->isize = isize;
+    	job->iblur = iblur;
+    	job->pad = (short)pad;
+    	job->page = page;
+    	job->x = gx;
+    	job->y = gy;
+    	job->w = gw;
+    	job->h = gh;
+    	return 1;
+    }
 
-    	if(params->flags & FONS_ZERO_TOPLEFT) {
-    		rx = (float)(int)(*x + xoff);
-    		ry = (float)(int)(*y + yoff);
+    void FONScontext::rasterizeMissing(FONSfont *font, const char* str, const char* end, short isize, short iblur)
+    {
+    	unsigned int codepoint;
+    	FONSrasterJob job;
 
-    		q->x0 = rx;
-    		q->y0 = ry;
-    		q->x1 = rx + x1 - x0;
-    		q->y1 = ry + y1 - y0;
+    	if(isize < 2) return;
+    	if(iblur > 20) iblur = 20;
 
-    		q->s0 = x0 * itw_;
-    		q->t0 = y0 * ith_;
-    		q->s1 = x1 * itw_;
-    		q->t1 = y1 * ith_;
-    	} else {
-    		rx = (float)(int)(*x + xoff);
-    		ry = (float)(int)(*y - yoff);
+    	rasterJobs.clear();
+    	FONSutf8Reader utf8(str, end);
+    	while (utf8.next(&codepoint))
+        {
+    		if(int* found = font->lut.find(FONSglyph::key(codepoint, isize, iblur)))
+            {
+    			// Keep glyphs of this text from being evicted for later ones.
+    			font->glyphs[*found].lastUse = frame;
+    			continue;
+    		}
+    		if(fons__reserveGlyph(this, font, codepoint, isize, iblur, &job) == 0)
+    			break;
+    		// Blank glyphs (spaces) have nothing to render.
+    		if(job.w > job.pad*2 && job.h > job.pad*2)
+    			rasterJobs.push_back(job);
+    	}
+    	rasterizeJobs();
+    }
+
+    void FONScontext::rasterizeJobs()
+    {
+    	int advance, lsb, x0, y0, x1, y1;
+    	if(rasterJobs.empty()) return;
+    	// Pages do not move any more, resolve destinations now.
+    	for(FONSrasterJob& job : rasterJobs)
+        {
+    		job.stride = params->width;
+    		job.dst = &pages[job.page].texData[job.x + job.y * params->width];
+    	}
+    	if(rasterPool != nullptr)
+        {
+    		rasterPool->run(rasterJobs);
+        }
+        else
+        {
+    		for(const FONSrasterJob& job : rasterJobs)
+            {
+    			float size = job.isize/10.0f;
+    			if(job.face->buildGlyphBitmap(job.index, size, job.face->getPixelHeightScale(size), &advance, &lsb, &x0, &y0, &x1, &y1))
+    				FONSrasterPool::writeGlyph(job.face->font_->glyph->bitmap, job);
+    		}
+    	}
+    	rasterJobs.clear();
+    }
+
+    int FONScontext::prewarm(const FONSprewarm& req)
+    {
+    	std::vector<unsigned int> chunk;
+    	unsigned int codepoint;
+    	int added = 0;
+    	bool room = true;
+
+    	if(req.font < 0 || req.font >= (int)fonts.size()) return 0;
+    	FONSfont *font = fonts[req.font].get();
+    	if(font->face == nullptr) return 0;
+
+    	// Large ranges go through in chunks instead of being listed first.
+    	chunk.reserve(FONS_PREWARM_CHUNK);
+    	for(const FONSprewarm::Range& r : req.ranges)
+        {
+    		for(uint64_t cp = r.first; cp <= r.last && room; ++cp)
+            {
+    			chunk.push_back((unsigned int)cp);
+    			if((int)chunk.size() == FONS_PREWARM_CHUNK)
+    				room = prewarmChunk(font, req, chunk, &added);
+    		}
+    	}
+    	if(req.sample != nullptr)
+        {
+    		FONSutf8Reader utf8(req.sample, req.sample + strlen(req.sample));
+    		while(room && utf8.next(&codepoint))
+            {
+    			chunk.push_back(codepoint);
+    			if((int)chunk.size() == FONS_PREWARM_CHUNK)
+    				room = prewarmChunk(font, req, chunk, &added);
+    		}
+    	}
+    	if(room && !chunk.empty())
+    		prewarmChunk(font, req, chunk, &added);
+
+    	// Upload every touched page once.
+    	flush();
+    	return added;
+    }
+
+    bool FONScontext::prewarmChunk(FONSfont *font, const FONSprewarm& req, std::vector<unsigned int>& codepoints, int* added)
+    {
+    	struct Pending {
+    		unsigned int codepoint;
+    		short isize, iblur;
+    		int w, h;
+    	};
+    	std::vector<Pending> pending;
+    	FONSrasterJob job;
+    	bool room = true;
+
+    	// Measure everything that is not cached yet.
+    	const std::vector<float> noBlur{0.0f};
+    	const std::vector<float>& blurs = req.blurs.empty() ? noBlur : req.blurs;
+    	for(float size : req.sizes)
+        {
+    		short isize = (short)(size*10.0f);
+    		for(float blur : blurs)
+            {
+    			short iblur = (short)mini((int)blur, 20);
+    			int pad = iblur+2;
+    			for(unsigned int cp : codepoints)
+                {
+    				if(font->lut.find(FONSglyph::key(cp, isize, iblur))) continue;
+    				FONSglyphMetrics* m = fons__getGlyphMetrics(this, font, cp, isize);
+    				if(m == nullptr) continue;
+    				pending.push_back(Pending{cp, isize, iblur, m->x1-m->x0 + pad*2, m->y1-m->y0 + pad*2});
+    			}
+    		}
+    	}
+    	codepoints.clear();
+
+    	// Tallest first, the skyline then packs rows of similar height.
+    	std::stable_sort(pending.begin(), pending.end(), [](const Pending& a, const Pending& b) {
+    		return a.h != b.h ? a.h > b.h : a.w > b.w;
+    	});
+
+    	// Repeated codepoints are found in the table by the time they come up.
+    	rasterJobs.clear();
+    	for(const Pending& p : pending)
+        {
+    		if(font->lut.find(FONSglyph::key(p.codepoint, p.isize, p.iblur))) continue;
+    		if(fons__reserveGlyph(this, font, p.codepoint, p.isize, p.iblur, &job) == 0)
+            {
+    			room = false;
+    			break;
+    		}
+    		(*added)++;
+    		if(job.w > job.pad*2 && job.h > job.pad*2)
+    			rasterJobs.push_back(job);
+    	}
+    	rasterizeJobs();
+    	return room;
+    }
+
+    // Trims the span a0..a1, mapped to u0..u1, to lo..hi. Either end may be
+    // the lower one. Returns false if nothing is left.
+    static bool fons__clipSpan(float* a0, float* a1, float* u0, float* u1, float lo, float hi)
+    {
+    	if(fmaxf(*a0, *a1) <= lo || fminf(*a0, *a1) >= hi) return false;
+    	float b0 = fminf(fmaxf(*a0, lo), hi);
+    	float b1 = fminf(fmaxf(*a1, lo), hi);
+    	if(b0 != *a0 || b1 != *a1) {
+    		float du = (*u1 - *u0) / (*a1 - *a0);
+    		float c0 = *u0 + (b0 - *a0) * du;
+    		float c1 = *u1 + (b1 - *a1) * du;
+    		*u0 = c0;
+    		*u1 = c1;
+    	}
+    	*a0 = b0;
+    	*a1 = b1;
+    	return true;
+    }
+
+    // Trims 'q' to the rect 'clip', returns false if it lies outside.
+    static bool fons__clipQuad(FONSquad* q, const float* clip)
+    {
+    	return fons__clipSpan(&q->x0, &q->x1, &q->s0, &q->s1, clip[0], clip[2]) &&
+    		   fons__clipSpan(&q->y0, &q->y1, &q->t0, &q->t1, clip[1], clip[3]);
+    }
+
+    // Trims 'inst' to the rect 'clip' grown to whole pixels, instance records
+    // map texels 1:1 and cannot be cut finer. Returns false if it lies outside.
+    static bool fons__clipInstance(FONSinstance* inst, unsigned char flags, const float* clip)
+    {
+    	int w = inst->u1 - inst->u0;
+    	int h = inst->v1 - inst->v0;
+    	int cx0 = (int)std::floor(clip[0]), cy0 = (int)std::floor(clip[1]);
+    	int cx1 = (int)std::ceil(clip[2]), cy1 = (int)std::ceil(clip[3]);
+    	int left = maxi(cx0 - inst->x, 0);
+    	int right = maxi(inst->x + w - cx1, 0);
+    	// Texel rows cut at the v0 and the v1 side.
+    	int top, bottom;
+    	if(flags & FONS_ZERO_TOPLEFT) {
+    		top = maxi(cy0 - inst->y, 0);
+    		bottom = maxi(inst->y + h - cy1, 0);
+    	} else {
+    		top = maxi(inst->y - cy1, 0);
+    		bottom = maxi(cy0 - (inst->y - h), 0);
+    	}
+    	if(left + right >= w || top + bottom >= h) return false;
+    	inst->x = (short)(inst->x + left);
+    	inst->y = (short)((flags & FONS_ZERO_TOPLEFT) ? inst->y + top : inst->y - top);
+    	inst->u0 = (unsigned short)(inst->u0 + left);
+    	inst->u1 = (unsigned short)(inst->u1 - right);
+    	inst->v0 = (unsigned short)(inst->v0 + top);
+    	inst->v1 = (unsigned short)(inst->v1 - bottom);
+    	return true;
+    }
+
+    // Pen position past which no glyph can reach into the clip: glyph quads
+    // start at most an em and their blur padding left of the pen.
+    static float fons__clipRight(const float* clip, short isize, short iblur)
+    {
+    	return clip[2] + isize/10.0f + mini(iblur, 20) + 2;
+    }
+
+    // Kerning in pixels between two glyphs of 'font'. Glyph indices only
+    // mean something within their face, so glyphs from different fallback
+    // fonts are not kerned. 'scale' is the pixel scale of 'font' itself.
+    static float fons__kernAdvance(FONScontext* stash, FONSfont *font, int prevGlyphIndex, int prevFallback,
+    							   int index, int fallback, float scale, short isize)
+    {
+    	if(prevFallback != fallback) return 0.0f;
+    	if(fallback == 0) return font->face->getGlyphKernAdvance(prevGlyphIndex, index) * scale;
+    	FONSface* face = stash->fonts[font->fallbacks[fallback - 1]]->face.get();
+    	return face->getGlyphKernAdvance(prevGlyphIndex, index) * face->getPixelHeightScale(isize/10.0f);
+    }
+
+    void FONScontext::getQuad(FONSfont *font, int prevGlyphIndex, int prevFallback, FONSglyph* glyph, float scale, float spacing, float* x, float* y, FONSquad* q)
+    {
+    	float rx,ry,xoff,yoff,x0,y0,x1,y1;
+
+    	if(prevGlyphIndex != -1) {
+    		float adv = fons__kernAdvance(this, font, prevGlyphIndex, prevFallback, glyph->index, glyph->fallback, scale, glyph->size);
+    		*x += (int)(adv + spacing + 0.5f);
+    	}
+
+    	// Each glyph has 2px border to allow good interpolation,
+    	// one pixel to prevent leaking, and one to allow good interpolation for rendering.
+    	// Inset the texture region by one pixel for correct interpolation.
+    	xoff = (short)(glyph->xoff+1);
+    	yoff = (short)(glyph->yoff+1);
+    	x0 = (float)(glyph->x0+1);
+    	y0 = (float)(glyph->y0+1);
+    	x1 = (float)(glyph->x1-1);
+    	y1 = (float)(glyph->y1-1);
+
+    	if(params->flags & FONS_ZERO_TOPLEFT) {
+    		rx = (float)(int)(*x + xoff);
+    		ry = (float)(int)(*y + yoff);
+
+    		q->x0 = rx;
+    		q->y0 = ry;
+    		q->x1 = rx + x1 - x0;
+    		q->y1 = ry + y1 - y0;
+
+    		q->s0 = x0 * itw_;
+    		q->t0 = y0 * ith_;
+    		q->s1 = x1 * itw_;
+    		q->t1 = y1 * ith_;
+    	} else {
+    		rx = (float)(int)(*x + xoff);
+    		ry = (float)(int)(*y - yoff);
 
     		q->x0 = rx;
     		q->y0 = ry;
@@ -651,49 +1372,347 @@ namespace fontstash {
     		q->t1 = y1 * ith_;
     	}
 
+    	q->page = glyph->page;
+
     	*x += (int)(glyph->xadv / 10.0f + 0.5f);
     }
 
+    bool FONScontext::getInstance(FONSfont *font, int prevGlyphIndex, int prevFallback, FONSglyph* glyph, float scale, float spacing, float* x, float* y, unsigned int color, FONSinstance* inst)
+    {
+    	int rx,ry;
+
+    	if(prevGlyphIndex != -1) {
+    		float adv = fons__kernAdvance(this, font, prevGlyphIndex, prevFallback, glyph->index, glyph->fallback, scale, glyph->size);
+    		*x += (int)(adv + spacing + 0.5f);
+    	}
+
+    	// Same placement and inset as getQuad().
+    	rx = (int)(*x + (short)(glyph->xoff+1));
+    	if(params->flags & FONS_ZERO_TOPLEFT)
+    		ry = (int)(*y + (short)(glyph->yoff+1));
+    	else
+    		ry = (int)(*y - (short)(glyph->yoff+1));
+
+    	*x += (int)(glyph->xadv / 10.0f + 0.5f);
+
+    	if(rx < SHRT_MIN || rx > SHRT_MAX || ry < SHRT_MIN || ry > SHRT_MAX)
+    		return false;
+    	inst->x = (short)rx;
+    	inst->y = (short)ry;
+    	inst->u0 = (unsigned short)(glyph->x0+1);
+    	inst->v0 = (unsigned short)(glyph->y0+1);
+    	inst->u1 = (unsigned short)(glyph->x1-1);
+    	inst->v1 = (unsigned short)(glyph->y1-1);
+    	inst->c = color;
+    	return true;
+    }
+
+    void FONScontext::getMetricsQuad(FONSfont *font, int prevGlyphIndex, int prevFallback, const FONSglyphMetrics* m, short isize, short iblur, float scale, float spacing, float* x, float* y, FONSquad* q)
+    {
+    	float rx,ry,xoff,yoff,w,h;
+    	int pad = mini(iblur, 20) + 2;
+
+    	if(prevGlyphIndex != -1) {
+    		float adv = fons__kernAdvance(this, font, prevGlyphIndex, prevFallback, m->index, m->fallback, scale, isize);
+    		*x += (int)(adv + spacing + 0.5f);
+    	}
+
+    	// Same placement as getQuad(), for a glyph padded and inset like in the atlas.
+    	xoff = (short)(m->x0 - pad + 1);
+    	yoff = (short)(m->y0 - pad + 1);
+    	w = (float)(m->x1 - m->x0 + pad*2 - 2);
+    	h = (float)(m->y1 - m->y0 + pad*2 - 2);
+
+    	rx = (float)(int)(*x + xoff);
+    	q->x0 = rx;
+    	q->x1 = rx + w;
+    	if(params->flags & FONS_ZERO_TOPLEFT) {
+    		ry = (float)(int)(*y + yoff);
+    		q->y0 = ry;
+    		q->y1 = ry + h;
+    	} else {
+    		ry = (float)(int)(*y - yoff);
+    		q->y0 = ry;
+    		q->y1 = ry - h;
+    	}
+    	q->s0 = q->t0 = q->s1 = q->t1 = 0.0f;
+    	q->page = INVALID;
+
+    	*x += (int)(m->xadv / 10.0f + 0.5f);
+    }
+
     void FONScontext::flush()
     {
-    	// Flush texture
-    	if(dirtyRect[0] < dirtyRect[2] && dirtyRect[1] < dirtyRect[3]) {
-            params->renderUpdate(dirtyRect, texData);
-    		// Reset dirty rect
-    		dirtyRect[0] = params->width;
-    		dirtyRect[1] = params->height;
-    		dirtyRect[2] = 0;
-    		dirtyRect[3] = 0;
+    	// Flush textures
+    	for(size_t i = 0; i < pages.size(); ++i)
+        {
+    		FONSpage& page = pages[i];
+    		if(page.dirty()) {
+    			params->renderUpdateRects((int)i, page.dirtyRects.rects(), page.dirtyRects.count(), page.texData.data());
+    			// Reset dirty rects
+    			page.resetDirty();
+    		}
+    	}
+
+    	if(params->flags & FONS_DEFER_DRAWS)
+        {
+    		submitBatches();
+    		return;
+    	}
+
+    	stats.peakVertices = maxi(stats.peakVertices, nverts);
+    	stats.peakInstances = maxi(stats.peakInstances, ninstances);
+    	if(nverts > 0 || ninstances > 0)
+    		stats.draws++;
+
+    	// Flush instances
+    	if(ninstances > 0)
+        {
+    		params->renderDrawInstanced(drawPage, idst, ninstances);
+    		ninstances = 0;
     	}
 
     	// Flush triangles
-    	if(nverts > 0)
+    	if(sink != nullptr)
+        {
+    		// Hand the buffer back even if nothing was written to it.
+    		params->renderDrawVertices(drawPage, nverts);
+    		sink = nullptr;
+    	}
+    	else if(nverts > 0)
+        {
+    		if(params->flags & FONS_INDEXED_QUADS)
+    			params->renderDrawIndexed(drawPage, vdst, tdst, cdst, nverts);
+    		else
+    			params->renderDrawPage(drawPage, vdst, tdst, cdst, nverts);
+    	}
+    	nverts = 0;
+    }
+
+    // Most vertices one batch may hold. Indexed quads are drawn with 16-bit
+    // indices, which address 65536 vertices.
+    static int fons__maxBatchVertices(int flags)
+    {
+    	return (flags & FONS_INDEXED_QUADS) ? 65536 : INT_MAX;
+    }
+
+    bool FONScontext::growBatch(FONSbatch& b, int nv, int ni)
+    {
+    	if(nv > vertexLimit || ni > vertexLimit)
+    		return false;
+    	if(nv > (int)b.colors.size())
+        {
+    		int cap = mini(maxi(maxi((int)b.colors.size() * 2, nv), FONS_VERTEX_COUNT), vertexLimit);
+    		b.verts.resize(cap*2);
+    		b.tcoords.resize(cap*2);
+    		b.colors.resize(cap);
+    		stats.grows++;
+    	}
+    	if(ni > (int)b.instances.size())
+        {
+    		b.instances.resize(mini(maxi(maxi((int)b.instances.size() * 2, ni), FONS_VERTEX_COUNT), vertexLimit));
+    		stats.grows++;
+    	}
+    	return true;
+    }
+
+    bool FONScontext::growStorage(int nv, int ni)
+    {
+    	// Arena arrays do not grow.
+    	if((nv > 0 && arena.verts != nullptr) || (ni > 0 && arena.instances != nullptr))
+    		return false;
+    	if(!growBatch(buffer, nverts + nv, ninstances + ni))
+    		return false;
+    	bindStorage();
+    	return true;
+    }
+
+    void FONScontext::bindStorage()
+    {
+    	if(arena.verts != nullptr)
+        {
+    		vdst = arena.verts;
+    		tdst = arena.tcoords;
+    		cdst = arena.colors;
+    		vcapacity = mini(arena.capacity, fons__maxBatchVertices(params->flags));
+    	}
+    	else
+        {
+    		vdst = buffer.verts.data();
+    		tdst = buffer.tcoords.data();
+    		cdst = buffer.colors.data();
+    		vcapacity = (int)buffer.colors.size();
+    	}
+    	if(arena.instances != nullptr)
+        {
+    		idst = arena.instances;
+    		icapacity = arena.capacity;
+    	}
+    	else
+        {
+    		idst = buffer.instances.data();
+    		icapacity = (int)buffer.instances.size();
+    	}
+    }
+
+    inline void FONScontext::setVertexLimit(int maxVertices)
+    {
+    	// Room for at least two quads as triangles, drawDebug reserves that.
+    	vertexLimit = mini(maxi(maxVertices, 12), fons__maxBatchVertices(params->flags));
+    }
+
+    inline int FONScontext::setVertexArena(const FONSvertexArena* a)
+    {
+    	if(a != nullptr && (a->verts == nullptr || a->tcoords == nullptr || a->colors == nullptr || a->capacity < 12))
+    		return 0;
+    	arena = a != nullptr ? *a : FONSvertexArena{};
+    	if(!(params->flags & FONS_DEFER_DRAWS))
+        {
+    		// The current batch is in the old storage.
+    		flush();
+    		bindStorage();
+    	}
+    	return 1;
+    }
+
+    void FONScontext::reserveBatch(int page, int nv, int ni)
+    {
+    	if((int)frameBatches.size() <= maxi(page, drawPage))
+    		frameBatches.resize(maxi(page, drawPage) + 1);
+    	if(page != drawPage)
+        {
+    		frameBatches[drawPage].nverts = nverts;
+    		frameBatches[drawPage].ninstances = ninstances;
+    		drawPage = page;
+    		nverts = frameBatches[page].nverts;
+    		ninstances = frameBatches[page].ninstances;
+    	}
+
+    	FONSbatch& b = frameBatches[page];
+    	if(!growBatch(b, nverts + nv, ninstances + ni))
+        {
+    		// Over the limit, submit the frame so far.
+    		stats.limitFlushes++;
+    		flush();
+    		growBatch(b, nv, ni);
+    	}
+    	vdst = b.verts.data();
+    	tdst = b.tcoords.data();
+    	cdst = b.colors.data();
+    	idst = b.instances.data();
+    }
+
+    void FONScontext::submitBatches()
+    {
+    	if(drawPage < (int)frameBatches.size())
+        {
+    		frameBatches[drawPage].nverts = nverts;
+    		frameBatches[drawPage].ninstances = ninstances;
+    	}
+    	for(size_t p = 0; p < frameBatches.size(); ++p)
+        {
+    		FONSbatch& b = frameBatches[p];
+    		stats.peakVertices = maxi(stats.peakVertices, b.nverts);
+    		stats.peakInstances = maxi(stats.peakInstances, b.ninstances);
+    		if(b.nverts > 0 || b.ninstances > 0)
+    			stats.draws++;
+    		if(b.ninstances > 0)
+    			params->renderDrawInstanced((int)p, b.instances.data(), b.ninstances);
+    		if(b.nverts > 0)
+            {
+    			if(params->flags & FONS_INDEXED_QUADS)
+    				params->renderDrawIndexed((int)p, b.verts.data(), b.tcoords.data(), b.colors.data(), b.nverts);
+    			else
+    				params->renderDrawPage((int)p, b.verts.data(), b.tcoords.data(), b.colors.data(), b.nverts);
+    		}
+    		b.nverts = 0;
+    		b.ninstances = 0;
+    	}
+    	nverts = 0;
+    	ninstances = 0;
+    }
+
+    void FONScontext::reserveInstances(int n, int page)
+    {
+    	if(params->flags & FONS_DEFER_DRAWS)
+        {
+    		reserveBatch(page, 0, n);
+    		return;
+    	}
+    	if(nverts > 0 || sink != nullptr || (ninstances > 0 && page != drawPage))
+    		flush();
+    	if(ninstances+n > mini(icapacity, vertexLimit) && !growStorage(0, n))
+        {
+    		stats.limitFlushes++;
+    		flush();
+    	}
+    	drawPage = page;
+    }
+
+    void FONScontext::reserveVertices(int n, int page)
+    {
+    	if(params->flags & FONS_DEFER_DRAWS)
+        {
+    		reserveBatch(page, n, 0);
+    		return;
+    	}
+    	if(ninstances > 0 || ((nverts > 0 || sink != nullptr) && page != drawPage))
+    		flush();
+    	if(sink != nullptr && nverts+n > mini(sinkCapacity, vertexLimit))
+        {
+    		// A mapped buffer cannot grow under the batch, ask for a larger one
+    		// next time if the backend gave all that was asked and the limit
+    		// allows more.
+    		if(sinkCapacity < vertexLimit && sinkCapacity >= sinkRequest)
+            {
+    			sinkRequest = mini(maxi(sinkRequest * 2, nverts + n), vertexLimit);
+    			stats.grows++;
+    		}
+    		else
+    			stats.limitFlushes++;
+    		flush();
+    	}
+    	else if(sink == nullptr && nverts+n > mini(vcapacity, vertexLimit) && !growStorage(n, 0))
+        {
+    		stats.limitFlushes++;
+    		flush();
+    	}
+    	drawPage = page;
+
+    	// A new batch asks the backend for a buffer to write into, if it has none
+    	// or too small a one the batch goes to the arrays as before. Batches go
+    	// to the arena instead when one is set.
+    	if(nverts == 0 && sink == nullptr && arena.verts == nullptr)
         {
-            params->renderDraw(verts, tcoords, colors, nverts);
-    		nverts = 0;
+    		sink = params->renderMapVertices(page, maxi(n, mini(sinkRequest, vertexLimit)), &sinkCapacity);
+    		if(sink != nullptr && sinkCapacity < n)
+            {
+    			params->renderDrawVertices(page, 0);
+    			sink = nullptr;
+    		}
     	}
     }
     static float fons__getVertAlign(FONScontext* stash, FONSfont *font, int align, short isize)
     {
     	if(stash->params->flags & FONS_ZERO_TOPLEFT) {
     		if(align & FONS_ALIGN_TOP) {
-    			return font->ascender * (float)isize/10.0f;
+    			return font->face->ascender * (float)isize/10.0f;
     		} else if(align & FONS_ALIGN_MIDDLE) {
-    			return (font->ascender + font->descender) / 2.0f * (float)isize/10.0f;
+    			return (font->face->ascender + font->face->descender) / 2.0f * (float)isize/10.0f;
     		} else if(align & FONS_ALIGN_BASELINE) {
     			return 0.0f;
     		} else if(align & FONS_ALIGN_BOTTOM) {
-    			return font->descender * (float)isize/10.0f;
+    			return font->face->descender * (float)isize/10.0f;
     		}
     	} else {
     		if(align & FONS_ALIGN_TOP) {
-    			return -font->ascender * (float)isize/10.0f;
+    			return -font->face->ascender * (float)isize/10.0f;
     		} else if(align & FONS_ALIGN_MIDDLE) {
-    			return -(font->ascender + font->descender) / 2.0f * (float)isize/10.0f;
+    			return -(font->face->ascender + font->face->descender) / 2.0f * (float)isize/10.0f;
     		} else if(align & FONS_ALIGN_BASELINE) {
     			return 0.0f;
     		} else if(align & FONS_ALIGN_BOTTOM) {
-    			return -font->descender * (float)isize/10.0f;
+    			return -font->face->descender * (float)isize/10.0f;
     		}
     	}
     	return 0.0;
@@ -703,24 +1722,26 @@ namespace fontstash {
     {
     	FONSstate* state = getState();
     	unsigned int codepoint;
-    	unsigned int utf8state = 0;
     	FONSglyph* glyph = nullptr;
     	FONSquad q;
-    	int prevGlyphIndex = -1;
+    	int prevGlyphIndex = -1, prevFallback = 0;
     	short isize = (short)(state->size*10.0f);
     	short iblur = static_cast<short>(state->blur);
     	float scale;
     	float width;
 
-    	if(state->font == FONSstate::npos || state->font >= fonts.size() - 1) return x;
+    	if(state->font == FONSstate::npos || state->font >= fonts.size()) return x;
     	FONSfont *font = fonts[state->font].get();
-    	if(font->data == nullptr) return x;
+    	if(font->face == nullptr) return x;
 
-    	scale = font->getPixelHeightScale(static_cast<float>(isize)/10.0f);
+    	scale = font->face->getPixelHeightScale(static_cast<float>(isize)/10.0f);
 
     	if(end == nullptr)
     		end = str + strlen(str);
 
+    	if(layoutCache != nullptr)
+    		return drawCached(x, y, str, end);
+
     	// Align horizontally
     	if(state->align & FONS_ALIGN_LEFT) {
     		// empty
@@ -734,30 +1755,241 @@ namespace fontstash {
     	// Align vertically.
     	y += fons__getVertAlign(this, font, state->align, isize);
 
-    	for (; str != end; ++str)
+    	// Batch rasterization would add clipped glyphs too.
+    	if(rasterPool != nullptr && !state->clipping)
+    		rasterizeMissing(font, str, end, isize, iblur);
+
+    	float clipRight = fons__clipRight(state->clip, isize, iblur);
+    	FONSutf8Reader utf8(str, end);
+    	while (utf8.next(&codepoint))
         {
-    		if(fontstash::decutf8(&utf8state, &codepoint, *(const unsigned char*)str))
-    			continue;
+    		if(state->clipping) {
+    			if(x > clipRight)
+    				break;
+    			// Glyphs outside the clip only move the pen, they are judged by
+    			// their measured quad and never enter the atlas.
+    			FONSglyphMetrics* m = fons__getGlyphMetrics(this, font, codepoint, isize);
+    			if(m != nullptr) {
+    				float mx = x, my = y;
+    				getMetricsQuad(font, prevGlyphIndex, prevFallback, m, isize, iblur, scale, state->spacing, &mx, &my, &q);
+    				if(!fons__clipQuad(&q, state->clip)) {
+    					x = mx;
+    					prevGlyphIndex = m->index;
+    					prevFallback = m->fallback;
+    					continue;
+    				}
+    			}
+    		}
     		glyph = fons__getGlyph(this, font, codepoint, isize, iblur);
-    		if(glyph != nullptr) {
-    			getQuad(font, prevGlyphIndex, glyph, scale, state->spacing, &x, &y, &q);
+    		if(glyph != nullptr && (params->flags & FONS_INSTANCED_QUADS)) {
+    			// Glyphs too far off screen for an instance record are skipped.
+    			reserveInstances(1, glyph->page);
+    			if(getInstance(font, prevGlyphIndex, prevFallback, glyph, scale, state->spacing, &x, &y, state->color, &idst[ninstances]) &&
+    			   (!state->clipping || fons__clipInstance(&idst[ninstances], params->flags, state->clip)))
+    				ninstances++;
+    		} else if(glyph != nullptr) {
+    			getQuad(font, prevGlyphIndex, prevFallback, glyph, scale, state->spacing, &x, &y, &q);
+
+    			if(!state->clipping || fons__clipQuad(&q, state->clip)) {
+    				// Vertices of a batch all sample from the same page.
+    				reserveVertices(quadVertices(), glyph->page);
+    				emitQuad(q.x0, q.y0, q.x1, q.y1, q.s0, q.t0, q.s1, q.t1, state->color);
+    			}
+    		}
+    		prevGlyphIndex = glyph != nullptr ? glyph->index : -1;
+    		prevFallback = glyph != nullptr ? glyph->fallback : 0;
+    	}
+    	if(!(params->flags & FONS_DEFER_DRAWS))
+    		flush();
+
+    	return x;
+    }
+
+    float FONScontext::buildTextBlob(FONStextBlob* blob, const char* str, const char* end)
+    {
+    	FONSstate* state = getState();
+
+    	if(end == nullptr)
+    		end = str + strlen(str);
+
+    	blob->text.assign(str, end);
+    	blob->font = state->font < fonts.size() ? (int)state->font : INVALID;
+    	blob->isize = (short)(state->size*10.0f);
+    	blob->iblur = (short)state->blur;
+    	blob->spacing = state->spacing;
+    	blob->align = state->align;
+    	blob->color = state->color;
+    	layoutBlob(blob);
+    	return blob->advance;
+    }
+
+    void FONScontext::layoutBlob(FONStextBlob* blob)
+    {
+    	blob->glyphs.clear();
+    	blob->dy = blob->advance = 0.0f;
+    	blob->generation = atlasGeneration_;
+    	blob->complete = true;
+
+    	if(blob->font == INVALID || blob->isize < 2) return;
+    	FONSfont *font = fonts[blob->font].get();
+    	if(font->face == nullptr) return;
 
-    			if(nverts+6 > FONS_VERTEX_COUNT)
-    				flush();
+    	const char* begin = blob->text.data();
+    	const char* end = begin + blob->text.size();
+    	float scale = font->face->getPixelHeightScale(static_cast<float>(blob->isize)/10.0f);
 
-    			vertex(q.x0, q.y0, q.s0, q.t0, state->color);
-    			vertex(q.x1, q.y1, q.s1, q.t1, state->color);
-    			vertex(q.x1, q.y0, q.s1, q.t0, state->color);
+    	if(rasterPool != nullptr)
+    		rasterizeMissing(font, begin, end, blob->isize, blob->iblur);
 
-    			vertex(q.x0, q.y0, q.s0, q.t0, state->color);
-    			vertex(q.x0, q.y1, q.s0, q.t1, state->color);
-    			vertex(q.x1, q.y1, q.s1, q.t1, state->color);
+    	// Evicting for a glyph met later can move the slots of earlier ones.
+    	// Lay out again then, the second pass finds the glyphs in the atlas.
+    	for(int pass = 0; pass < 2; ++pass)
+        {
+    		unsigned int generation = atlasGeneration_;
+    		unsigned int codepoint;
+    		int prevGlyphIndex = -1, prevFallback = 0;
+    		float x = 0.0f, y = 0.0f;
+    		FONSquad q;
+
+    		blob->glyphs.clear();
+    		blob->complete = true;
+    		FONSutf8Reader utf8(begin, end);
+    		while(utf8.next(&codepoint))
+            {
+    			FONSglyph* glyph = fons__getGlyph(this, font, codepoint, blob->isize, blob->iblur);
+    			if(glyph != nullptr) {
+    				// The pen stays on whole pixels from 0, so this splits exactly.
+    				float pen = x;
+    				getQuad(font, prevGlyphIndex, prevFallback, glyph, scale, blob->spacing, &x, &y, &q);
+    				float kern = q.x0 - pen - (short)(glyph->xoff+1);
+    				pen += kern;
+    				blob->glyphs.push_back(FONStextBlob::Glyph{kern, x - pen, q.x0 - pen, q.y0, q.x1 - pen, q.y1,
+    														   q.s0, q.t0, q.s1, q.t1, (int)(glyph - font->glyphs), glyph->page});
+    			} else {
+    				blob->complete = false;
+    			}
+    			prevGlyphIndex = glyph != nullptr ? glyph->index : -1;
+    			prevFallback = glyph != nullptr ? glyph->fallback : 0;
     		}
-    		prevGlyphIndex = glyph != nullptr ? glyph->index : -1;
+    		blob->advance = x;
+    		if(atlasGeneration_ == generation)
+    			break;
+    		blob->complete = false;
     	}
-    	flush();
+    	blob->generation = atlasGeneration_;
+    	blob->dy = fons__getVertAlign(this, font, blob->align, blob->isize);
+    }
 
-    	return x;
+    float FONScontext::drawTextBlob(FONStextBlob* blob, float x, float y)
+    {
+    	return drawBlob(blob, x, y, blob->color);
+    }
+
+    float FONScontext::drawBlob(FONStextBlob* blob, float x, float y, unsigned int color)
+    {
+    	if(blob->generation != atlasGeneration_ || !blob->complete)
+    		layoutBlob(blob);
+    	if(blob->font == INVALID) return x;
+    	FONSfont *font = fonts[blob->font].get();
+
+    	// Move the pen and snap quads as getQuad() does, so the result is
+    	// the same as from fonsDrawText. Alignment uses the advance measured
+    	// from 'x', like textBounds().
+    	float pen = x;
+    	if(!(blob->align & FONS_ALIGN_LEFT) && (blob->align & (FONS_ALIGN_RIGHT | FONS_ALIGN_CENTER)))
+        {
+    		if(blob->complete) {
+    			for(const FONStextBlob::Glyph& g : blob->glyphs)
+                {
+    				pen += g.kern;
+    				pen += g.advance;
+    			}
+    		} else {
+    			// Glyphs missing from the atlas still take up room.
+    			pen += measureText(font, blob->isize, blob->iblur, blob->spacing, blob->align, x, y,
+    							   blob->text.data(), blob->text.data() + blob->text.size(), nullptr);
+    		}
+    		float width = pen - x;
+    		pen = (blob->align & FONS_ALIGN_RIGHT) ? x - width : x - width * 0.5f;
+    	}
+    	// Clipped like fonsDrawText, with the current clip rect.
+    	const FONSstate* state = getState();
+    	float clipRight = fons__clipRight(state->clip, blob->isize, blob->iblur);
+    	float oy = y + blob->dy;
+    	for(const FONStextBlob::Glyph& g : blob->glyphs)
+        {
+    		if(state->clipping && pen > clipRight)
+    			break;
+    		FONSglyph& glyph = font->glyphs[g.slot];
+    		glyph.lastUse = frame;
+    		pen += g.kern;
+    		float rx = (float)(int)(pen + g.x0);
+    		float ry = (float)(int)(oy + g.y0);
+    		pen += g.advance;
+    		if(params->flags & FONS_INSTANCED_QUADS) {
+    			if(rx < SHRT_MIN || rx > SHRT_MAX || ry < SHRT_MIN || ry > SHRT_MAX)
+    				continue;
+    			FONSinstance inst;
+    			inst.x = (short)rx;
+    			inst.y = (short)ry;
+    			inst.u0 = (unsigned short)(glyph.x0+1);
+    			inst.v0 = (unsigned short)(glyph.y0+1);
+    			inst.u1 = (unsigned short)(glyph.x1-1);
+    			inst.v1 = (unsigned short)(glyph.y1-1);
+    			inst.c = color;
+    			if(state->clipping && !fons__clipInstance(&inst, params->flags, state->clip))
+    				continue;
+    			reserveInstances(1, g.page);
+    			idst[ninstances++] = inst;
+    		} else {
+    			FONSquad q = {rx, ry, g.s0, g.t0, rx + g.x1 - g.x0, ry + g.y1 - g.y0, g.s1, g.t1, g.page};
+    			if(state->clipping && !fons__clipQuad(&q, state->clip))
+    				continue;
+    			reserveVertices(quadVertices(), g.page);
+    			emitQuad(q.x0, q.y0, q.x1, q.y1, q.s0, q.t0, q.s1, q.t1, color);
+    		}
+    	}
+    	if(!(params->flags & FONS_DEFER_DRAWS))
+    		flush();
+
+    	return pen;
+    }
+
+    float FONScontext::drawCached(float x, float y, const char* str, const char* end)
+    {
+    	FONSstate* state = getState();
+    	int font = (int)state->font;
+    	short isize = (short)(state->size*10.0f);
+    	short iblur = static_cast<short>(state->blur);
+
+    	FONStextBlob* blob = layoutCache->find(str, end, font, isize, iblur, state->spacing, state->align);
+    	if(blob == nullptr) {
+    		blob = layoutCache->insert(str, end, font, isize, iblur, state->spacing, state->align);
+    		layoutBlob(blob);
+    	} else if(blob->generation != atlasGeneration_ || !blob->complete) {
+    		layoutCache->stats.relayouts++;
+    		layoutBlob(blob);
+    	}
+    	return drawBlob(blob, x, y, state->color);
+    }
+
+    inline void FONScontext::setLayoutCache(int maxEntries)
+    {
+    	if(maxEntries <= 0)
+    		layoutCache.reset();
+    	else if(layoutCache == nullptr || layoutCache->capacity() != maxEntries)
+    		layoutCache.reset(new FONSlayoutCache(maxEntries));
+    }
+
+    inline FONSlayoutStats FONScontext::layoutCacheStats() const
+    {
+    	return layoutCache != nullptr ? layoutCache->stats : FONSlayoutStats{};
+    }
+
+    inline void FONScontext::resetLayoutCacheStats()
+    {
+    	if(layoutCache != nullptr)
+    		layoutCache->stats = FONSlayoutStats{};
     }
 
     int FONScontext::fonsTextIterInit(FONStextIter* iter, float x, float y, const char* str, const char* end)
@@ -767,16 +1999,16 @@ namespace fontstash {
 
     	memset(iter, 0, sizeof(*iter));
 
-    	if(state->font == FONSstate::npos || state->font >= fonts.size() - 1)
+    	if(state->font == FONSstate::npos || state->font >= fonts.size())
         {
             return 0;
         }
     	iter->font = fonts[state->font].get();
-    	if(iter->font->data == nullptr) return 0;
+    	if(iter->font->face == nullptr) return 0;
 
     	iter->isize = (short)(state->size*10.0f);
     	iter->iblur = (short)state->blur;
-    	iter->scale = iter->font->getPixelHeightScale((float)iter->isize/10.0f);
+    	iter->scale = iter->font->face->getPixelHeightScale((float)iter->isize/10.0f);
 
     	// Align horizontally
     	if(state->align & FONS_ALIGN_LEFT) {
@@ -802,6 +2034,7 @@ namespace fontstash {
     	iter->end = end;
     	iter->codepoint = 0;
     	iter->prevGlyphIndex = -1;
+    	iter->prevFallback = 0;
 
     	return 1;
     }
@@ -817,22 +2050,20 @@ namespace fontstash {
     		return 0;
         }
 
-    	for (; str != iter->end; str++)
+    	unsigned int codepoint;
+    	if(fontstash::decutf8Block(&iter->utf8state, &iter->codepoint, &str, iter->end, &codepoint, 1) == 1)
         {
-    		if(fontstash::decutf8(&iter->utf8state, &iter->codepoint, *(const unsigned char*)str))
-    			continue;
-    		str++;
+    		iter->codepoint = codepoint;
     		// Get glyph and quad
     		iter->x = iter->nextx;
     		iter->y = iter->nexty;
     		glyph = fons__getGlyph(this, iter->font, iter->codepoint, iter->isize, iter->iblur);
     		if(glyph != nullptr)
             {
-    			getQuad(iter->font, iter->prevGlyphIndex, glyph, iter->scale, iter->spacing, &iter->nextx, &iter->nexty, quad);
+    			getQuad(iter->font, iter->prevGlyphIndex, iter->prevFallback, glyph, iter->scale, iter->spacing, &iter->nextx, &iter->nexty, quad);
             }
     		iter->prevGlyphIndex = glyph != nullptr ? glyph->index : -1;
-
-    		break;
+    		iter->prevFallback = glyph != nullptr ? glyph->fallback : 0;
     	}
     	iter->next = str;
 
@@ -846,70 +2077,68 @@ namespace fontstash {
     	float u = w == 0 ? 0 : (1.0f / w);
     	float v = h == 0 ? 0 : (1.0f / h);
 
-    	if(nverts+6+6 > FONS_VERTEX_COUNT)
-    		flush();
+    	// Pages are drawn side by side, each samples its own white rect.
+    	for(size_t p = 0; p < pages.size(); ++p, x += w + 10)
+        {
+    		FONSatlas* atlas = pages[p].atlas.get();
 
-    	// Draw background
-    	vertex(x+0, y+0, u, v, 0x0fffffff);
-    	vertex(x+w, y+h, u, v, 0x0fffffff);
-    	vertex(x+w, y+0, u, v, 0x0fffffff);
+    		reserveVertices(quadVertices()*2, (int)p);
 
-    	vertex(x+0, y+0, u, v, 0x0fffffff);
-    	vertex(x+0, y+h, u, v, 0x0fffffff);
-    	vertex(x+w, y+h, u, v, 0x0fffffff);
+    		// Draw background
+    		emitQuad(x+0, y+0, x+w, y+h, u, v, u, v, 0x0fffffff);
 
-    	// Draw texture
-    	vertex(x+0, y+0, 0, 0, 0xffffffff);
-    	vertex(x+w, y+h, 1, 1, 0xffffffff);
-    	vertex(x+w, y+0, 1, 0, 0xffffffff);
+    		// Draw texture
+    		emitQuad(x+0, y+0, x+w, y+h, 0, 0, 1, 1, 0xffffffff);
 
-    	vertex(x+0, y+0, 0, 0, 0xffffffff);
-    	vertex(x+0, y+h, 0, 1, 0xffffffff);
-    	vertex(x+w, y+h, 1, 1, 0xffffffff);
+    		// Drawbug draw atlas
+    		for(int i = 0; i < atlas->nnodes(); i++)
+            {
+    			FONSatlasNode* n = &atlas->nodes_[i];
 
-    	// Drawbug draw atlas
-    	for(int i = 0; i < atlas->nnodes(); i++)
-        {
-    		FONSatlasNode* n = &atlas->nodes_[i];
+    			reserveVertices(quadVertices(), (int)p);
+    			emitQuad(x+n->x+0, y+n->y+0, x+n->x+n->width, y+n->y+1, u, v, u, v, 0xc00000ff);
+    		}
 
-    		if(nverts + 6 > FONS_VERTEX_COUNT)
+    		// Draw shelf tops of freeable atlases
+    		for(const FONSatlasShelf& shelf : atlas->shelves())
             {
-    			flush();
-            }
-
-    		vertex(x+n->x+0, y+n->y+0, u, v, 0xc00000ff);
-    		vertex(x+n->x+n->width, y+n->y+1, u, v, 0xc00000ff);
-    		vertex(x+n->x+n->width, y+n->y+0, u, v, 0xc00000ff);
+    			float sy = (float)(shelf.y + shelf.height);
 
-    		vertex(x+n->x+0, y+n->y+0, u, v, 0xc00000ff);
-    		vertex(x+n->x+0, y+n->y+1, u, v, 0xc00000ff);
-    		vertex(x+n->x+n->width, y+n->y+1, u, v, 0xc00000ff);
+    			reserveVertices(quadVertices(), (int)p);
+    			emitQuad(x+0, y+sy-1, x+w, y+sy, u, v, u, v, 0xc00000ff);
+    		}
     	}
 
-    	flush();
+    	if(!(params->flags & FONS_DEFER_DRAWS))
+    		flush();
     }
 
     float FONScontext::textBounds(float x, float y, const char* str, const char* end, float* bounds)
     {
     	FONSstate* state = getState();
+
+    	if(state->font == FONSstate::npos || state->font >= fonts.size()) return 0;
+    	FONSfont *font = fonts[state->font].get();
+    	return measureText(font, (short)(state->size*10.0f), (short)state->blur, state->spacing, state->align,
+    					   x, y, str, end, bounds);
+    }
+
+    float FONScontext::measureText(FONSfont *font, short isize, short iblur, float spacing, int align,
+    							   float x, float y, const char* str, const char* end, float* bounds)
+    {
     	unsigned int codepoint;
-    	unsigned int utf8state = 0;
     	FONSquad q;
-    	FONSglyph* glyph = nullptr;
-    	int prevGlyphIndex = -1;
-    	short isize = (short)(state->size*10.0f);
-    	short iblur = (short)state->blur;
+    	FONSglyphMetrics* metrics = nullptr;
+    	int prevGlyphIndex = -1, prevFallback = 0;
     	float scale;
     	float startx, advance;
 
-    	if(state->font == FONSstate::npos || state->font >= fonts.size() - 1) return 0;
-    	FONSfont *font = fonts[state->font].get();
-    	if(font->data == nullptr) return 0;
+    	if(font->face == nullptr) return 0;
 
-    	scale = font->getPixelHeightScale(static_cast<float>(isize)/10.0f);
+    	scale = font->face->getPixelHeightScale(static_cast<float>(isize)/10.0f);
 
     	// Align vertically.
-    	y += fons__getVertAlign(this, font, state->align, isize);
+    	y += fons__getVertAlign(this, font, align, isize);
 
     	float minx, miny, maxx, maxy;
     	minx = maxx = x;
@@ -921,15 +2150,13 @@ namespace fontstash {
     		end = str + strlen(str);
         }
 
-    	for (; str != end; ++str)
+    	FONSutf8Reader utf8(str, end);
+    	while (utf8.next(&codepoint))
         {
-    		if(fontstash::decutf8(&utf8state, &codepoint, *(const unsigned char*)str))
-            {
-    			continue;
-            }
-    		glyph = fons__getGlyph(this, font, codepoint, isize, iblur);
-    		if(glyph != nullptr) {
-    			getQuad(font, prevGlyphIndex, glyph, scale, state->spacing, &x, &y, &q);
+    		// Measuring never touches the atlas.
+    		metrics = fons__getGlyphMetrics(this, font, codepoint, isize);
+    		if(metrics != nullptr) {
+    			getMetricsQuad(font, prevGlyphIndex, prevFallback, metrics, isize, iblur, scale, spacing, &x, &y, &q);
     			if(q.x0 < minx) minx = q.x0;
     			if(q.x1 > maxx) maxx = q.x1;
     			if(params->flags & FONS_ZERO_TOPLEFT)
@@ -943,18 +2170,19 @@ namespace fontstash {
     				if(q.y0 > maxy) maxy = q.y0;
     			}
     		}
-    		prevGlyphIndex = glyph != nullptr ? glyph->index : -1;
+    		prevGlyphIndex = metrics != nullptr ? metrics->index : -1;
+    		prevFallback = metrics != nullptr ? metrics->fallback : 0;
     	}
 
     	advance = x - startx;
 
     	// Align horizontally
-    	if(state->align & FONS_ALIGN_LEFT) {
+    	if(align & FONS_ALIGN_LEFT) {
     		// empty
-    	} else if(state->align & FONS_ALIGN_RIGHT) {
+    	} else if(align & FONS_ALIGN_RIGHT) {
     		minx -= advance;
     		maxx -= advance;
-    	} else if(state->align & FONS_ALIGN_CENTER) {
+    	} else if(align & FONS_ALIGN_CENTER) {
     		minx -= advance * 0.5f;
     		maxx -= advance * 0.5f;
     	}
@@ -975,28 +2203,28 @@ namespace fontstash {
     	FONSstate* state = getState();
     	short isize;
 
-    	if(state->font == FONSstate::npos || state->font >= fonts.size() - 1)
+    	if(state->font == FONSstate::npos || state->font >= fonts.size())
         {
             return;
         }
     	FONSfont *font = fonts[state->font].get();
     	isize = (short)(state->size*10.0f);
-    	if(font->data == nullptr)
+    	if(font->face == nullptr)
         {
             return;
         }
 
     	if(ascender)
         {
-    		*ascender = font->ascender*isize/10.0f;
+    		*ascender = font->face->ascender*isize/10.0f;
         }
     	if(descender)
         {
-    		*descender = font->descender*isize/10.0f;
+    		*descender = font->face->descender*isize/10.0f;
         }
     	if(lineh)
         {
-    		*lineh = font->lineh*isize/10.0f;
+    		*lineh = font->face->lineh*isize/10.0f;
         }
     }
 
@@ -1005,13 +2233,13 @@ namespace fontstash {
     	FONSstate* state = getState();
     	short isize;
 
-    	if(state->font == FONSstate::npos || state->font >= fonts.size() - 1)
+    	if(state->font == FONSstate::npos || state->font >= fonts.size())
         {
             return;
         }
     	FONSfont *font = fonts[state->font].get();
     	isize = static_cast<short>(state->size*10.0f);
-    	if(font->data == nullptr)
+    	if(font->face == nullptr)
         {
             return;
         }
@@ -1020,17 +2248,17 @@ namespace fontstash {
 
     	if(params->flags & FONS_ZERO_TOPLEFT)
         {
-    		*miny = y - font->ascender * static_cast<float>(isize) / 10.0f;
-    		*maxy = *miny + font->lineh * isize / 10.0f;
+    		*miny = y - font->face->ascender * static_cast<float>(isize) / 10.0f;
+    		*maxy = *miny + font->face->lineh * isize / 10.0f;
     	}
         else
         {
-    		*maxy = y + font->descender * static_cast<float>(isize) / 10.0f;
-    		*miny = *maxy - font->lineh * isize / 10.0f;
+    		*maxy = y + font->face->descender * static_cast<float>(isize) / 10.0f;
+    		*miny = *maxy - font->face->lineh * isize / 10.0f;
     	}
     }
 
-    const unsigned char* FONScontext::fonsGetTextureData(int* width, int* height)
+    const unsigned char* FONScontext::fonsGetTextureData(int* width, int* height, int page)
     {
     	if(width != nullptr)
         {
@@ -1040,27 +2268,35 @@ namespace fontstash {
     	{
         	*height = params->height;
         }
-    	return texData;
+    	if(page < 0 || page >= (int)pages.size())
+        {
+    		return nullptr;
+        }
+    	return pages[page].texData.data();
     }
 
-    int FONScontext::fonsValidateTexture(int* dirty)
+    int FONScontext::fonsValidateTexture(int* dirty, int page)
     {
-    	if(dirtyRect[0] < dirtyRect[2] && dirtyRect[1] < dirtyRect[3])
+    	if(page < 0 || page >= (int)pages.size())
         {
-    		dirty[0] = dirtyRect[0];
-    		dirty[1] = dirtyRect[1];
-    		dirty[2] = dirtyRect[2];
-    		dirty[3] = dirtyRect[3];
-    		// Reset dirty rect
-    		dirtyRect[0] = params->width;
-    		dirtyRect[1] = params->height;
-    		dirtyRect[2] = 0;
-    		dirtyRect[3] = 0;
+    		return 0;
+        }
+    	FONSpage& p = pages[page];
+    	if(p.dirty())
+        {
+    		p.dirtyRects.bounds(dirty, params->width, params->height);
+    		// Reset dirty rects
+    		p.resetDirty();
     		return 1;
     	}
     	return 0;
     }
 
+    inline int FONScontext::fonsGetPageCount() const
+    {
+    	return (int)pages.size();
+    }
+
     inline void FONScontext::fonsSetErrorCallback(void (*callback)(void* uptr, int error, int val), void* uptr)
     {
     	handleError = callback;
@@ -1075,8 +2311,6 @@ namespace fontstash {
 
     int FONScontext::fonsExpandAtlas(int width, int height)
     {
-    	int maxy = 0;
-
     	width = maxi(width, params->width);
     	height = maxi(height, params->height);
 
@@ -1088,53 +2322,309 @@ namespace fontstash {
     	// Flush pending glyphs.
     	flush();
 
-    	// Create new texture
+    	// Create new textures
         if(params->renderResize(width, height) == 0)
         {
     			return 0;
     	}
-    	// Copy old texture data over.
-    	unsigned char *data = reinterpret_cast<unsigned char*>(std::calloc(width * height, sizeof(unsigned char)));
-    	if(data == nullptr)
-        {
-    		return 0;
-        }
-    	for(int i = 0; i < params->height; ++i)
+    	for(FONSpage& page : pages)
         {
-    		unsigned char *dst = &data[i*width];
-    		unsigned char *src = &texData[i*params->width];
-    		memcpy(dst, src, params->width);
-    		if(width > params->width)
+    		// Copy old texture data over.
+    		std::vector<unsigned char> data(width * height, 0);
+    		for(int i = 0; i < params->height; ++i)
+            {
+    			memcpy(&data[i*width], &page.texData[i*params->width], params->width);
+    		}
+    		page.texData.swap(data);
+
+    		// Increase atlas size
+    		page.atlas->expand(width, height);
+
+    		// Add existing data as dirty.
+    		int maxy = 0;
+    		for (int i = 0; i < page.atlas->nnodes(); ++i)
+            {
+    			maxy = maxi(maxy, page.atlas->nodes_[i].y);
+            }
+    		for (const FONSatlasShelf& shelf : page.atlas->shelves())
             {
-    			memset(dst+params->width, 0, width - params->width);
+    			maxy = maxi(maxy, shelf.y + shelf.height);
             }
+    		page.resetDirty();
+    		page.markDirty(0, 0, params->width, maxy);
     	}
-    	if(height > params->height)
+
+    	params->width = width;
+    	params->height = height;
+    	itw_ = 1.0f / params->width;
+    	ith_ = 1.0f / params->height;
+    	// Texture coordinates are relative to the atlas size.
+    	atlasGeneration_++;
+
+    	return 1;
+    }
+
+    inline void FONScontext::endFrame()
+    {
+    	if(params->flags & FONS_DEFER_DRAWS)
+    		flush();
+    	frame++;
+    }
+
+    inline void FONScontext::setFontRegistry(std::shared_ptr<FONSfontRegistry> fontRegistry)
+    {
+    	registry = std::move(fontRegistry);
+    }
+
+    inline void FONScontext::setRasterThreads(int n)
+    {
+    	n = mini(n, FONS_MAX_RASTER_THREADS);
+    	if(n <= 1)
+    		rasterPool.reset();
+    	else if(rasterPool == nullptr || rasterPool->size() != n)
+    		rasterPool.reset(new FONSrasterPool(n));
+    }
+
+    // Identifies a font and its fallback chain in cache files.
+    static uint64_t fons__cacheFontKey(FONScontext* stash, FONSfont *font)
+    {
+    	uint64_t key = font->face->dataHash();
+    	for(int i = 0; i < font->nfallbacks; ++i)
+    		key = (key ^ stash->fonts[font->fallbacks[i]]->face->dataHash()) * 0x100000001B3ull;
+    	return key;
+    }
+
+    static uint32_t fons__cacheFreetypeVersion()
+    {
+    	FT_Int major, minor, patch;
+    	FT_Library_Version(ftLibrary, &major, &minor, &patch);
+    	return (uint32_t)(major << 16 | minor << 8 | patch);
+    }
+
+    // Glyph records go field by field, struct padding never reaches the file.
+    static void fons__cachePutGlyph(FONScacheWriter& out, const FONSglyph& glyph)
+    {
+    	out.put<uint32_t>(glyph.codepoint);
+    	out.put<int32_t>(glyph.index);
+    	out.put(glyph.page);
+    	out.put(glyph.fallback);
+    	out.put(glyph.size);
+    	out.put(glyph.blur);
+    	out.put(glyph.x0);
+    	out.put(glyph.y0);
+    	out.put(glyph.x1);
+    	out.put(glyph.y1);
+    	out.put(glyph.xadv);
+    	out.put(glyph.xoff);
+    	out.put(glyph.yoff);
+    }
+
+    static bool fons__cacheGetGlyph(FONScacheReader& in, FONSglyph* glyph)
+    {
+    	uint32_t codepoint;
+    	int32_t index;
+    	if(!in.get(&codepoint) || !in.get(&index)) return false;
+    	glyph->codepoint = codepoint;
+    	glyph->index = index;
+    	glyph->lastUse = 0;
+    	return in.get(&glyph->page) && in.get(&glyph->fallback) && in.get(&glyph->size) && in.get(&glyph->blur) &&
+    	       in.get(&glyph->x0) && in.get(&glyph->y0) && in.get(&glyph->x1) && in.get(&glyph->y1) &&
+    	       in.get(&glyph->xadv) && in.get(&glyph->xoff) && in.get(&glyph->yoff);
+    }
+
+    static void fons__cachePutMetrics(FONScacheWriter& out, const FONSglyphMetrics& m)
+    {
+    	out.put<int32_t>(m.index);
+    	out.put(m.fallback);
+    	out.put(m.xadv);
+    	out.put(m.x0);
+    	out.put(m.y0);
+    	out.put(m.x1);
+    	out.put(m.y1);
+    }
+
+    static bool fons__cacheGetMetrics(FONScacheReader& in, FONSglyphMetrics* m)
+    {
+    	int32_t index;
+    	if(!in.get(&index)) return false;
+    	m->index = index;
+    	return in.get(&m->fallback) && in.get(&m->xadv) &&
+    	       in.get(&m->x0) && in.get(&m->y0) && in.get(&m->x1) && in.get(&m->y1);
+    }
+
+    inline int FONScontext::saveCache(const char* path)
+    {
+    	FONScacheWriter out;
+    	out.bytes(FONS_CACHE_MAGIC, sizeof(FONS_CACHE_MAGIC));
+    	out.put<uint32_t>(FONS_CACHE_VERSION);
+    	out.put<uint32_t>(fons__cacheFreetypeVersion());
+    	out.put<int32_t>(params->width);
+    	out.put<int32_t>(params->height);
+    	out.put<uint32_t>(params->flags & FONS_EVICT_LRU);
+    	out.put<int32_t>((int32_t)pages.size());
+    	out.put<int32_t>((int32_t)fonts.size());
+
+    	for(const FONSpage& page : pages)
         {
-    		memset(&data[params->height * width], 0, (height - params->height) * width);
-        }
+    		page.atlas->serialize(out);
+    		out.bytes(page.texData.data(), page.texData.size());
+    	}
+    	for(const auto &font : fonts)
+        {
+    		out.put<uint64_t>(fons__cacheFontKey(this, font.get()));
+    		out.put<int32_t>(font->nglyphs);
+    		for(int i = 0; i < font->nglyphs; ++i)
+    			fons__cachePutGlyph(out, font->glyphs[i]);
+    		out.put<int32_t>(font->metrics.size());
+    		font->metrics.forEach([&](uint64_t key, const FONSglyphMetrics& m) {
+    			out.put(key);
+    			fons__cachePutMetrics(out, m);
+    		});
+    	}
 
-    	free(texData);
-    	texData = data;
+    	// Write aside and rename, so a crash never leaves a truncated cache.
+    	std::string tmp = std::string(path) + ".tmp";
+    	FILE* fp = fons__fopen(tmp.c_str(), "wb");
+    	if(fp == nullptr) return 0;
+    	size_t written = fwrite(out.buffer.data(), 1, out.buffer.size(), fp);
+    	if(fclose(fp) != 0 || written != out.buffer.size())
+        {
+    		remove(tmp.c_str());
+    		return 0;
+    	}
+    #ifdef _WIN32
+    	remove(path);
+    #endif
+    	return rename(tmp.c_str(), path) == 0;
+    }
 
-    	// Increase atlas size
-    	atlas->expand(width, height);
+    inline int FONScontext::loadCache(const char* path)
+    {
+    	struct Entry {
+    		uint64_t key;
+    		std::vector<FONSglyph> glyphs;
+    		std::vector<std::pair<uint64_t, FONSglyphMetrics>> metrics;
+    	};
+    	FONSmappedFile file;
+    	if(!file.open(path)) return 0;
+    	FONScacheReader in(file.data(), file.size());
+
+    	// Header, anything that changes how glyphs rasterize or pack invalidates the file.
+    	const unsigned char* magic = in.bytes(sizeof(FONS_CACHE_MAGIC));
+    	uint32_t version, ftVersion, flags;
+    	int32_t width, height, npages, nfonts;
+    	if(magic == nullptr || memcmp(magic, FONS_CACHE_MAGIC, sizeof(FONS_CACHE_MAGIC)) != 0) return 0;
+    	if(!in.get(&version) || version != FONS_CACHE_VERSION) return 0;
+    	if(!in.get(&ftVersion) || ftVersion != fons__cacheFreetypeVersion()) return 0;
+    	if(!in.get(&width) || !in.get(&height) || width != params->width || height != params->height) return 0;
+    	if(!in.get(&flags) || flags != (uint32_t)(params->flags & FONS_EVICT_LRU)) return 0;
+    	if(!in.get(&npages) || npages < 1 || npages > FONS_MAX_PAGES) return 0;
+    	if(!in.get(&nfonts) || nfonts < 0) return 0;
+
+    	// Parse everything before touching the stash.
+    	std::vector<FONSpage> loaded;
+    	for(int i = 0; i < npages; ++i)
+        {
+    		loaded.emplace_back(width, height, flags != 0);
+    		if(!loaded.back().atlas->deserialize(in)) return 0;
+    		const unsigned char* pixels = in.bytes((size_t)width * height);
+    		if(pixels == nullptr) return 0;
+    		memcpy(loaded.back().texData.data(), pixels, (size_t)width * height);
+    	}
+    	std::vector<Entry> entries(nfonts);
+    	for(Entry& entry : entries)
+        {
+    		int32_t nglyphs, nmetrics;
+    		if(!in.get(&entry.key) || !in.get(&nglyphs) || nglyphs < 0) return 0;
+    		entry.glyphs.resize(nglyphs);
+    		for(FONSglyph& glyph : entry.glyphs)
+            {
+    			if(!fons__cacheGetGlyph(in, &glyph)) return 0;
+    			if(glyph.page < 0 || glyph.page >= npages || glyph.fallback < 0 || glyph.fallback > FONS_MAX_FALLBACKS || glyph.x0 < 0 || glyph.y0 < 0 ||
+    			   glyph.x1 > width || glyph.y1 > height || glyph.x0 > glyph.x1 || glyph.y0 > glyph.y1)
+    				return 0;
+    			glyph.lastUse = frame;
+    		}
+    		if(!in.get(&nmetrics) || nmetrics < 0) return 0;
+    		entry.metrics.resize(nmetrics);
+    		for(auto& m : entry.metrics)
+            {
+    			if(!in.get(&m.first) || !fons__cacheGetMetrics(in, &m.second)) return 0;
+    		}
+    	}
+    	if(!in.atEnd()) return 0;
 
-    	// Add existing data as dirty.
-    	for (int i = 0; i < atlas->nnodes(); ++i)
+    	// Match entries to loaded fonts, a cache for none of them is useless.
+    	std::vector<FONSfont*> owners(entries.size(), nullptr);
+    	std::vector<bool> matched(fonts.size(), false);
+    	int nmatched = 0;
+    	for(size_t e = 0; e < entries.size(); ++e)
         {
-    		maxy = maxi(maxy, atlas->nodes_[i].y);
-        }
-    	dirtyRect[0] = 0;
-    	dirtyRect[1] = 0;
-    	dirtyRect[2] = params->width;
-    	dirtyRect[3] = maxy;
+    		for(size_t i = 0; i < fonts.size(); ++i)
+            {
+    			if(!matched[i] && fonts[i]->face != nullptr && fons__cacheFontKey(this, fonts[i].get()) == entries[e].key)
+                {
+    				matched[i] = true;
+    				owners[e] = fonts[i].get();
+    				nmatched++;
+    				break;
+    			}
+    		}
+    	}
+    	if(nmatched == 0) return 0;
 
-    	params->width = width;
-    	params->height = height;
-    	itw_ = 1.0f / params->width;
-    	ith_ = 1.0f / params->height;
+    	// Backend textures for pages the stash does not have yet.
+    	for(int i = (int)pages.size(); i < npages; ++i)
+        {
+    		if(params->renderAddPage(i) == 0) return 0;
+    	}
+
+    	flush();
+    	int nextra = (int)pages.size() - npages;
+    	for(int i = 0; i < nextra; ++i)
+    		loaded.emplace_back(width, height, flags != 0);
+    	pages.swap(loaded);
+    	atlasGeneration_++;
+    	for(int i = npages; i < npages + nextra; ++i)
+    		addWhiteRect(2, 2, i);
+
+    	for(const auto &font : fonts)
+        {
+    		font->nglyphs = 0;
+    		font->lut.clear();
+    	}
+    	lru_.clear();
+    	for(size_t e = 0; e < entries.size(); ++e)
+        {
+    		const Entry& entry = entries[e];
+    		FONSfont *font = owners[e];
+    		if(font == nullptr)
+            {
+    			// Stale entry, give its atlas space back where the allocator allows it.
+    			for(const FONSglyph& g : entry.glyphs)
+                {
+    				FONSpage& page = pages[g.page];
+    				if(page.atlas->freeRect(g.x0, g.y0, g.x1 - g.x0, g.y1 - g.y0))
+                    {
+    					for(int y = g.y0; y < g.y1; ++y)
+    						memset(&page.texData[g.x0 + y * width], 0, g.x1 - g.x0);
+    				}
+    			}
+    			continue;
+    		}
+    		for(const FONSglyph& g : entry.glyphs)
+            {
+    			*font->allocGlyph() = g;
+    			font->lut.insert(FONSglyph::key(g.codepoint, g.size, g.blur), font->nglyphs-1);
+    			trackGlyph(font, g);
+    		}
+    		for(const auto& m : entry.metrics)
+    			font->metrics.insert(m.first, m.second);
+    	}
 
+    	// The backend textures still hold the old atlas.
+    	for(FONSpage& page : pages)
+    		page.markDirty(0, 0, width, height);
     	return 1;
     }
 
@@ -1149,32 +2639,26 @@ namespace fontstash {
     			return 0;
     	}
 
-    	// Reset atlas
-    	atlas->reset(width, height);
-
-    	// Clear texture data.
-    	texData = (unsigned char*)realloc(texData, width * height);
-    	if(texData == nullptr)
+    	// Reset atlas pages, the backend keeps its page textures.
+    	for(FONSpage& page : pages)
         {
-            return 0;
-        }
-    	memset(texData, 0, width * height);
+    		page.atlas->reset(width, height);
+
+    		// Clear texture data.
+    		page.texData.assign(width * height, 0);
 
-    	// Reset dirty rect
-    	dirtyRect[0] = width;
-    	dirtyRect[1] = height;
-    	dirtyRect[2] = 0;
-    	dirtyRect[3] = 0;
+    		// Reset dirty rects
+    		page.resetDirty();
+    	}
 
     	// Reset cached glyphs
     	for(const auto &font : fonts)
         {
     		font->nglyphs = 0;
-    		for (int j = 0; j < FONS_HASH_LUT_SIZE; j++)
-    	   	{
-                font->lut[j] = -1;
-            }
+    		font->lut.clear();
     	}
+    	lru_.clear();
+    	atlasGeneration_++;
 
     	params->width = width;
     	params->height = height;
@@ -1182,7 +2666,10 @@ namespace fontstash {
     	ith_ = 1.0f/params->height;
 
     	// Add white rect at 0,0 for debug drawing.
-    	addWhiteRect(2, 2);
+    	for(size_t i = 0; i < pages.size(); ++i)
+        {
+    		addWhiteRect(2, 2, (int)i);
+        }
 
     	return 1;
     }
@@ -1,19 +1,37 @@
 #pragma once
 #include <vector>
 #include <cstdlib>
+#include "fontstash/fs_cache.hpp"
+#include "fontstash/fs_util.hpp"
 namespace fontstash {
     // Atlas based on Skyline Bin Packer by Jukka Jylänki
     struct FONSatlasNode {
         short x, y, width;
     };
 
+    // Shelf allocator used when glyphs can be evicted. Every shelf is a
+    // horizontal band of the atlas with a sorted free list of spans, freed
+    // rects go back to the span list and empty shelves merge with empty
+    // neighbours so their space can be handed out at a different height.
+    struct FONSatlasSpan {
+        short x, width;
+    };
+
+    struct FONSatlasShelf {
+        short y, height;
+        int used;
+        std::vector<FONSatlasSpan> spans;
+    };
+
     struct FONSatlas {
 
-        FONSatlas(int w, int h, int c) :
+        FONSatlas(int w, int h, int c, bool freeable = false) :
             width{w},
             height{h},
             nnodes_{0},
-            cnodes_{c}
+            cnodes_{c},
+            freeable_{freeable},
+            shelfTop_{0}
         {
 
             // Allocate space for skyline nodes_
@@ -72,6 +90,10 @@ namespace fontstash {
             if (w > width)
             {
                 insertNode(nnodes_, width, 0, w - width);
+                for (auto& shelf : shelves_)
+                {
+                    releaseSpan(shelf, width, w - width);
+                }
             }
             width = w;
             height = h;
@@ -82,6 +104,8 @@ namespace fontstash {
             width = w;
             height = h;
             nnodes_ = 0;
+            shelves_.clear();
+            shelfTop_ = 0;
 
             // Init root node.
             nodes_[0].x = 0;
@@ -151,6 +175,9 @@ namespace fontstash {
 
         int addRect(int rw, int rh, int* rx, int* ry)
         {
+            if (freeable_)
+                return addShelfRect(rw, rh, rx, ry);
+
             int besth = height, bestw = width, besti = -1;
             int bestx = -1, besty = -1, i;
 
@@ -181,13 +208,224 @@ namespace fontstash {
             return 1;
         }
 
+        // Returns a rect allocated by addRect() to the atlas. Only supported
+        // by freeable atlases, returns 0 for skyline atlases.
+        int freeRect(int rx, int ry, int rw, int rh)
+        {
+            (void)rh;
+            if (!freeable_)
+                return 0;
+            for (size_t i = 0; i < shelves_.size(); ++i)
+            {
+                FONSatlasShelf& shelf = shelves_[i];
+                if (shelf.y != ry)
+                    continue;
+                releaseSpan(shelf, rx, rw);
+                shelf.used -= rw;
+                if (shelf.used == 0)
+                    mergeEmptyShelves((int)i);
+                return 1;
+            }
+            return 0;
+        }
+
+        // Writes the allocator state, see FONScontext::saveCache().
+        void serialize(FONScacheWriter& out) const
+        {
+            out.put<int32_t>(nnodes_);
+            out.bytes(nodes_.data(), sizeof(FONSatlasNode) * nnodes_);
+            out.put<int32_t>(shelfTop_);
+            out.put<int32_t>((int32_t)shelves_.size());
+            for (const FONSatlasShelf& shelf : shelves_)
+            {
+                out.put(shelf.y);
+                out.put(shelf.height);
+                out.put<int32_t>(shelf.used);
+                out.put<int32_t>((int32_t)shelf.spans.size());
+                out.bytes(shelf.spans.data(), sizeof(FONSatlasSpan) * shelf.spans.size());
+            }
+        }
+
+        // Restores state written by serialize() into an atlas of the same size.
+        bool deserialize(FONScacheReader& in)
+        {
+            int32_t n, top, nshelves;
+            if (!in.get(&n) || n < 1) return false;
+            const unsigned char* src = in.bytes(sizeof(FONSatlasNode) * n);
+            if (src == nullptr) return false;
+            if (n > cnodes_)
+            {
+                cnodes_ = n;
+                nodes_.resize(cnodes_);
+            }
+            memcpy(nodes_.data(), src, sizeof(FONSatlasNode) * n);
+            nnodes_ = n;
+
+            if (!in.get(&top) || !in.get(&nshelves) || nshelves < 0) return false;
+            shelfTop_ = top;
+            shelves_.clear();
+            for (int32_t i = 0; i < nshelves; ++i)
+            {
+                FONSatlasShelf shelf;
+                int32_t used, nspans;
+                if (!in.get(&shelf.y) || !in.get(&shelf.height) || !in.get(&used) || !in.get(&nspans) || nspans < 0)
+                    return false;
+                src = in.bytes(sizeof(FONSatlasSpan) * nspans);
+                if (src == nullptr) return false;
+                shelf.used = used;
+                shelf.spans.resize(nspans);
+                memcpy(shelf.spans.data(), src, sizeof(FONSatlasSpan) * nspans);
+                shelves_.push_back(std::move(shelf));
+            }
+            return true;
+        }
+
         int nnodes() const { return nnodes_; }
         int cnodes() const { return cnodes_; }
+        bool freeable() const { return freeable_; }
+        const std::vector<FONSatlasShelf>& shelves() const { return shelves_; }
 
         int width, height;
         // FONSatlasNode* nodes_;
         std::vector<FONSatlasNode> nodes_;
         int nnodes_;
         int cnodes_;
+
+    private:
+        int addShelfRect(int rw, int rh, int* rx, int* ry)
+        {
+            int best = -1, bestWaste = height;
+            bool bestEmpty = false;
+
+            if (rw > width)
+                return 0;
+
+            // Find the shelf that fits with least wasted height. A tall shelf is
+            // only used by a short glyph if a new shelf cannot be opened.
+            for (size_t i = 0; i < shelves_.size(); ++i)
+            {
+                const FONSatlasShelf& shelf = shelves_[i];
+                if (shelf.height < rh)
+                    continue;
+                // Empty shelves are split to size below, so they waste nothing.
+                int waste = shelf.used == 0 ? 0 : shelf.height - rh;
+                if (waste >= bestWaste)
+                    continue;
+                if (shelf.used == 0)
+                {
+                    best = (int)i;
+                    bestWaste = waste;
+                    bestEmpty = true;
+                    continue;
+                }
+                for (const auto& span : shelf.spans)
+                {
+                    if (span.width >= rw)
+                    {
+                        best = (int)i;
+                        bestWaste = waste;
+                        bestEmpty = false;
+                        break;
+                    }
+                }
+            }
+
+            int shelfh = mini(alignShelf(rh), height - shelfTop_);
+            if ((best == -1 || bestWaste > rh / 2) && shelfh >= rh)
+            {
+                FONSatlasShelf shelf;
+                shelf.y = (short)shelfTop_;
+                shelf.height = (short)shelfh;
+                shelf.used = 0;
+                shelf.spans.push_back(FONSatlasSpan{0, (short)width});
+                shelves_.push_back(shelf);
+                shelfTop_ += shelfh;
+                best = (int)shelves_.size() - 1;
+                bestEmpty = true;
+            }
+            if (best == -1)
+                return 0;
+
+            // Split empty shelves that are much taller than needed, the
+            // remainder stays available for other heights.
+            if (bestEmpty && shelves_[best].height > alignShelf(rh))
+            {
+                int h = alignShelf(rh);
+                FONSatlasShelf rest;
+                rest.y = (short)(shelves_[best].y + h);
+                rest.height = (short)(shelves_[best].height - h);
+                rest.used = 0;
+                rest.spans.push_back(FONSatlasSpan{0, (short)width});
+                shelves_[best].height = (short)h;
+                shelves_.insert(shelves_.begin() + best + 1, rest);
+            }
+
+            FONSatlasShelf& shelf = shelves_[best];
+            for (size_t i = 0; i < shelf.spans.size(); ++i)
+            {
+                FONSatlasSpan& span = shelf.spans[i];
+                if (span.width < rw)
+                    continue;
+                *rx = span.x;
+                *ry = shelf.y;
+                span.x += (short)rw;
+                span.width -= (short)rw;
+                if (span.width == 0)
+                    shelf.spans.erase(shelf.spans.begin() + i);
+                shelf.used += rw;
+                return 1;
+            }
+            return 0;
+        }
+
+        static int alignShelf(int h)
+        {
+            return (h + 3) & ~3;
+        }
+
+        void releaseSpan(FONSatlasShelf& shelf, int x, int w)
+        {
+            size_t i = 0;
+            while (i < shelf.spans.size() && shelf.spans[i].x < x)
+                ++i;
+            shelf.spans.insert(shelf.spans.begin() + i, FONSatlasSpan{(short)x, (short)w});
+            // Merge with next, then previous span.
+            if (i + 1 < shelf.spans.size() && shelf.spans[i].x + shelf.spans[i].width == shelf.spans[i+1].x)
+            {
+                shelf.spans[i].width += shelf.spans[i+1].width;
+                shelf.spans.erase(shelf.spans.begin() + i + 1);
+            }
+            if (i > 0 && shelf.spans[i-1].x + shelf.spans[i-1].width == shelf.spans[i].x)
+            {
+                shelf.spans[i-1].width += shelf.spans[i].width;
+                shelf.spans.erase(shelf.spans.begin() + i);
+            }
+        }
+
+        void mergeEmptyShelves(int idx)
+        {
+            // Merge with empty neighbours.
+            if (idx + 1 < (int)shelves_.size() && shelves_[idx+1].used == 0)
+            {
+                shelves_[idx].height += shelves_[idx+1].height;
+                shelves_.erase(shelves_.begin() + idx + 1);
+            }
+            if (idx > 0 && shelves_[idx-1].used == 0)
+            {
+                shelves_[idx-1].height += shelves_[idx].height;
+                shelves_.erase(shelves_.begin() + idx);
+                idx--;
+            }
+            // Give the space of the topmost shelf back to the open area.
+            if (idx == (int)shelves_.size() - 1)
+            {
+                shelfTop_ = shelves_[idx].y;
+                shelves_.pop_back();
+            }
+        }
+
+        bool freeable_;
+        std::vector<FONSatlasShelf> shelves_;
+        int shelfTop_;
     };
 }
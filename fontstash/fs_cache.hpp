@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace fontstash {
+    // Bumped whenever the layout of a cache file changes.
+    static constexpr uint32_t FONS_CACHE_VERSION = 3;
+    static constexpr char FONS_CACHE_MAGIC[8] = {'F','O','N','S','C','A','C','H'};
+
+    // Appends plain values to a byte buffer in host byte order. Cache files
+    // are only meant to be read back on the machine that wrote them.
+    struct FONScacheWriter {
+        template<typename T>
+        void put(const T& value)
+        {
+            bytes(&value, sizeof(T));
+        }
+
+        void bytes(const void* src, size_t n)
+        {
+            const unsigned char* p = static_cast<const unsigned char*>(src);
+            buffer.insert(buffer.end(), p, p + n);
+        }
+
+        std::vector<unsigned char> buffer;
+    };
+
+    // Reads back what FONScacheWriter wrote. Every read is bounds checked,
+    // a truncated or damaged file makes the reader fail instead of crashing.
+    struct FONScacheReader {
+        FONScacheReader(const unsigned char* data, size_t size) :
+            p_{data},
+            end_{data + size}
+        {
+        }
+
+        template<typename T>
+        bool get(T* value)
+        {
+            const unsigned char* src = bytes(sizeof(T));
+            if (src == nullptr) return false;
+            memcpy(value, src, sizeof(T));
+            return true;
+        }
+
+        // Returns a pointer to the next 'n' bytes and skips them.
+        const unsigned char* bytes(size_t n)
+        {
+            if (static_cast<size_t>(end_ - p_) < n) return nullptr;
+            const unsigned char* src = p_;
+            p_ += n;
+            return src;
+        }
+
+        bool atEnd() const { return p_ == end_; }
+
+    private:
+        const unsigned char* p_;
+        const unsigned char* end_;
+    };
+
+    // 64-bit hash of a byte range, used to recognize font data.
+    inline uint64_t hashBytes(const unsigned char* data, size_t size)
+    {
+        const uint64_t prime = 0x100000001B3ull;
+        uint64_t h = 0xCBF29CE484222325ull ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (h ^ word) * prime;
+            h ^= h >> 29;
+        }
+        for (; i < size; ++i)
+        {
+            h = (h ^ data[i]) * prime;
+        }
+        return h ^ (h >> 32);
+    }
+}
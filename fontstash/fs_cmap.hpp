@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include "fontstash/fs_hash.hpp"
+
+namespace fontstash {
+    // Caches codepoint to (font slot, glyph index) resolution, including the
+    // walk over fallback fonts. Slot 0 is the font itself, slot i+1 is its
+    // i'th fallback. Misses are cached too, as slot 0 with glyph 0.
+    // BMP codepoints map through a two level direct table of 256 entry
+    // pages allocated on first use, the rest go to a hash map.
+    struct FONScmapCache {
+        FONScmapCache() :
+            astral_{16}
+        {
+        }
+
+        bool find(unsigned int codepoint, int* slot, int* glyph)
+        {
+            uint32_t entry = 0;
+            if (codepoint < 0x10000)
+            {
+                const uint32_t* page = pages_[codepoint >> 8].get();
+                if (page != nullptr) entry = page[codepoint & 0xff];
+            }
+            else if (uint32_t* found = astral_.find(codepoint))
+            {
+                entry = *found;
+            }
+            if (entry == 0) return false;
+            *slot = static_cast<int>((entry >> 16) & 0x7fff);
+            *glyph = static_cast<int>(entry & 0xffff);
+            return true;
+        }
+
+        void insert(unsigned int codepoint, int slot, int glyph)
+        {
+            uint32_t entry = RESOLVED | (static_cast<uint32_t>(slot) << 16) | (static_cast<uint32_t>(glyph) & 0xffff);
+            if (codepoint < 0x10000)
+            {
+                std::unique_ptr<uint32_t[]>& page = pages_[codepoint >> 8];
+                if (!page) page.reset(new uint32_t[256]());
+                page[codepoint & 0xff] = entry;
+            }
+            else
+            {
+                astral_.insert(codepoint, entry);
+            }
+        }
+
+        void clear()
+        {
+            for (auto& page : pages_)
+                page.reset();
+            astral_.clear();
+        }
+
+    private:
+        static constexpr uint32_t RESOLVED = 0x80000000u;
+        std::unique_ptr<uint32_t[]> pages_[256];
+        FONShashMap<uint32_t> astral_;
+    };
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <climits>
+#include "fontstash/fs_util.hpp"
+
+#ifndef FONS_MAX_DIRTY_RECTS
+#   define FONS_MAX_DIRTY_RECTS 8
+#endif
+
+namespace fontstash {
+    // Changed parts of a texture as a few disjoint rects. A new rect is
+    // merged with a neighbour when the clean pixels that adds to the upload
+    // cost less than a separate upload, when it overlaps one, or when the
+    // set is full.
+    struct FONSdirtyRects {
+        // Clean pixels worth uploading to save one upload call.
+        static constexpr int MERGE_PIXELS = 1024;
+
+        void clear()
+        {
+            n_ = 0;
+        }
+
+        bool empty() const { return n_ == 0; }
+        int count() const { return n_; }
+        // x0,y0,x1,y1 of each rect.
+        const int* rects() const { return &r_[0][0]; }
+
+        void add(int x0, int y0, int x1, int y1)
+        {
+            if (x0 >= x1 || y0 >= y1) return;
+            int cur[4] = {x0, y0, x1, y1};
+            for (;;)
+            {
+                int best = -1;
+                long bestCost = LONG_MAX;
+                bool overlap = false;
+                for (int i = 0; i < n_ && !overlap; ++i)
+                {
+                    int u[4];
+                    unite(cur, r_[i], u);
+                    long cost = area(u) - area(cur) - area(r_[i]);
+                    overlap = cur[0] < r_[i][2] && r_[i][0] < cur[2] && cur[1] < r_[i][3] && r_[i][1] < cur[3];
+                    if (overlap || cost < bestCost)
+                    {
+                        best = i;
+                        bestCost = cost;
+                    }
+                }
+                if (best < 0 || !(overlap || bestCost <= MERGE_PIXELS || n_ == FONS_MAX_DIRTY_RECTS)) break;
+
+                // Merging may make the rect overlap others, try again.
+                unite(cur, r_[best], cur);
+                n_--;
+                for (int k = 0; k < 4; ++k) r_[best][k] = r_[n_][k];
+            }
+            for (int k = 0; k < 4; ++k) r_[n_][k] = cur[k];
+            n_++;
+        }
+
+        // Bounding box of all rects, empty (x0 >= x1) if there are none.
+        void bounds(int* b, int w, int h) const
+        {
+            b[0] = w;
+            b[1] = h;
+            b[2] = 0;
+            b[3] = 0;
+            for (int i = 0; i < n_; ++i)
+            {
+                b[0] = mini(b[0], r_[i][0]);
+                b[1] = mini(b[1], r_[i][1]);
+                b[2] = maxi(b[2], r_[i][2]);
+                b[3] = maxi(b[3], r_[i][3]);
+            }
+        }
+
+        // Pixels covered, what uploading every rect transfers.
+        long pixels() const
+        {
+            long sum = 0;
+            for (int i = 0; i < n_; ++i) sum += area(r_[i]);
+            return sum;
+        }
+
+    private:
+        static long area(const int* r)
+        {
+            return (long)(r[2] - r[0]) * (r[3] - r[1]);
+        }
+
+        static void unite(const int* a, const int* b, int* out)
+        {
+            int u[4] = {mini(a[0], b[0]), mini(a[1], b[1]), maxi(a[2], b[2]), maxi(a[3], b[3])};
+            for (int k = 0; k < 4; ++k) out[k] = u[k];
+        }
+
+        int r_[FONS_MAX_DIRTY_RECTS][4];
+        int n_ = 0;
+    };
+}
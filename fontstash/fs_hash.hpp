@@ -0,0 +1,132 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace fontstash {
+    // Open addressing hash map from packed 64-bit keys to small values.
+    // Keys and values are kept in separate arrays so probing only walks the
+    // densely packed key array. Linear probing with backward shift deletion,
+    // so there are no tombstones and lookups stay short after erases.
+    template<typename T>
+    struct FONShashMap {
+        static constexpr uint64_t EMPTY = ~uint64_t(0);
+
+        explicit FONShashMap(int initialCapacity = 16) :
+            count_{0}
+        {
+            int cap = 8;
+            while (cap < initialCapacity)
+                cap *= 2;
+            keys_.assign(cap, EMPTY);
+            values_.resize(cap);
+        }
+
+        T* find(uint64_t key)
+        {
+            unsigned int mask = capacity() - 1;
+            for (unsigned int i = slot(key);; i = (i + 1) & mask)
+            {
+                if (keys_[i] == key) return &values_[i];
+                if (keys_[i] == EMPTY) return nullptr;
+            }
+        }
+
+        // Inserts or overwrites the value stored for 'key'.
+        void insert(uint64_t key, T value)
+        {
+            // Keep load factor at or below 1/2.
+            if ((count_ + 1) * 2 > capacity())
+                rehash(capacity() * 2);
+            unsigned int mask = capacity() - 1;
+            unsigned int i = slot(key);
+            while (keys_[i] != EMPTY && keys_[i] != key)
+                i = (i + 1) & mask;
+            if (keys_[i] == EMPTY) count_++;
+            keys_[i] = key;
+            values_[i] = value;
+        }
+
+        bool erase(uint64_t key)
+        {
+            unsigned int mask = capacity() - 1;
+            unsigned int i = slot(key);
+            while (keys_[i] != key)
+            {
+                if (keys_[i] == EMPTY) return false;
+                i = (i + 1) & mask;
+            }
+            // Shift back entries that were displaced past the removed slot.
+            unsigned int j = i;
+            for (;;)
+            {
+                j = (j + 1) & mask;
+                if (keys_[j] == EMPTY) break;
+                unsigned int home = slot(keys_[j]);
+                // Move entry j into the hole at i unless its home lies cyclically in (i, j].
+                if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
+                {
+                    keys_[i] = keys_[j];
+                    values_[i] = values_[j];
+                    i = j;
+                }
+            }
+            keys_[i] = EMPTY;
+            count_--;
+            return true;
+        }
+
+        void clear()
+        {
+            std::fill(keys_.begin(), keys_.end(), EMPTY);
+            count_ = 0;
+        }
+
+        int size() const { return count_; }
+        int capacity() const { return static_cast<int>(keys_.size()); }
+
+        // Iterate occupied slots, used when serializing or rebuilding.
+        template<typename F>
+        void forEach(F fn) const
+        {
+            for (size_t i = 0; i < keys_.size(); ++i)
+            {
+                if (keys_[i] != EMPTY) fn(keys_[i], values_[i]);
+            }
+        }
+
+    private:
+        unsigned int slot(uint64_t key) const
+        {
+            // Fibonacci hashing, the upper half of the product is well mixed.
+            uint64_t h = key * 0x9E3779B97F4A7C15ull;
+            return static_cast<unsigned int>(h >> 32) & (capacity() - 1);
+        }
+
+        void rehash(int newCapacity)
+        {
+            std::vector<uint64_t> oldKeys;
+            std::vector<T> oldValues;
+            oldKeys.swap(keys_);
+            oldValues.swap(values_);
+            keys_.assign(newCapacity, EMPTY);
+            values_.resize(newCapacity);
+            count_ = 0;
+            unsigned int mask = capacity() - 1;
+            for (size_t i = 0; i < oldKeys.size(); ++i)
+            {
+                if (oldKeys[i] == EMPTY) continue;
+                unsigned int j = slot(oldKeys[i]);
+                while (keys_[j] != EMPTY)
+                    j = (j + 1) & mask;
+                keys_[j] = oldKeys[i];
+                values_[j] = oldValues[i];
+                count_++;
+            }
+        }
+
+        std::vector<uint64_t> keys_;
+        std::vector<T> values_;
+        int count_;
+    };
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "fontstash/fs_cache.hpp"
+#include "fontstash/fs_hash.hpp"
+
+namespace fontstash {
+    // Counters of the layout cache, see FONScontext::layoutCacheStats().
+    struct FONSlayoutStats {
+        int hits;
+        int misses;
+        int evictions;      // Entries replaced to make room.
+        int relayouts;      // Hits laid out again because the atlas changed.
+    };
+
+    // Bounded cache of strings laid out by fonsDrawText, see
+    // FONScontext::setLayoutCache(). Entries are text blobs keyed by a hash
+    // of the string and the parts of the style that change layout, color is
+    // applied when drawing. A hash match is confirmed against the stored
+    // string and style. When the cache is full a clock sweep replaces an
+    // entry that has not been hit since the hand last passed it.
+    struct FONSlayoutCache {
+        explicit FONSlayoutCache(int capacity) :
+            stats{},
+            capacity_{capacity},
+            hand_{0},
+            lut_{capacity * 2}
+        {
+            entries_.reserve(capacity);
+        }
+
+        // Returns the entry holding 'str' laid out in the given style, or null.
+        FONStextBlob* find(const char* str, const char* end, int font, short isize, short iblur, float spacing, int align)
+        {
+            uint64_t k = key(str, end, font, isize, iblur, spacing, align);
+            int* found = lut_.find(k);
+            if (found != nullptr)
+            {
+                Entry& e = entries_[*found];
+                const FONStextBlob& b = e.blob;
+                if (b.font == font && b.isize == isize && b.iblur == iblur && b.spacing == spacing && b.align == align &&
+                    b.text.size() == (size_t)(end - str) && memcmp(b.text.data(), str, end - str) == 0)
+                {
+                    e.referenced = true;
+                    stats.hits++;
+                    return &e.blob;
+                }
+            }
+            stats.misses++;
+            return nullptr;
+        }
+
+        // Returns an entry for 'str' in the given style, with the text and
+        // style set and the layout left to the caller.
+        FONStextBlob* insert(const char* str, const char* end, int font, short isize, short iblur, float spacing, int align)
+        {
+            uint64_t k = key(str, end, font, isize, iblur, spacing, align);
+            int index;
+            if (int* found = lut_.find(k))
+            {
+                // Same hash, different string or style.
+                index = *found;
+            }
+            else if ((int)entries_.size() < capacity_)
+            {
+                index = (int)entries_.size();
+                entries_.emplace_back();
+                lut_.insert(k, index);
+            }
+            else
+            {
+                while (entries_[hand_].referenced)
+                {
+                    entries_[hand_].referenced = false;
+                    hand_ = (hand_ + 1) % capacity_;
+                }
+                index = hand_;
+                hand_ = (hand_ + 1) % capacity_;
+                lut_.erase(entries_[index].key);
+                lut_.insert(k, index);
+                stats.evictions++;
+            }
+
+            Entry& e = entries_[index];
+            e.key = k;
+            e.referenced = true;
+            // Assigning keeps the allocations of a replaced entry.
+            e.blob.text.assign(str, end);
+            e.blob.font = font;
+            e.blob.isize = isize;
+            e.blob.iblur = iblur;
+            e.blob.spacing = spacing;
+            e.blob.align = align;
+            return &e.blob;
+        }
+
+        int size() const { return (int)entries_.size(); }
+        int capacity() const { return capacity_; }
+
+        FONSlayoutStats stats;
+
+    private:
+        struct Entry {
+            uint64_t key = 0;
+            bool referenced = false;
+            FONStextBlob blob;
+        };
+
+        static uint64_t key(const char* str, const char* end, int font, short isize, short iblur, float spacing, int align)
+        {
+            const uint64_t prime = 0x100000001B3ull;
+            uint32_t spacingBits;
+            memcpy(&spacingBits, &spacing, sizeof(spacingBits));
+            uint64_t h = hashBytes(reinterpret_cast<const unsigned char*>(str), end - str);
+            h = (h ^ (uint32_t)font) * prime;
+            h = (h ^ (((uint64_t)(unsigned short)isize << 16) | (unsigned short)iblur)) * prime;
+            h = (h ^ spacingBits) * prime;
+            h = (h ^ (uint32_t)align) * prime;
+            // The hash map reserves one key value.
+            return h != FONShashMap<int>::EMPTY ? h : 0;
+        }
+
+        int capacity_;
+        int hand_;
+        std::vector<Entry> entries_;
+        FONShashMap<int> lut_;
+    };
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <cstddef>
+
+#ifdef _WIN32
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+namespace fontstash {
+    // Read-only memory mapping of a whole file.
+    struct FONSmappedFile {
+        FONSmappedFile() :
+            data_{nullptr},
+            size_{0}
+        {
+        }
+
+        FONSmappedFile(const FONSmappedFile&) = delete;
+        FONSmappedFile& operator=(const FONSmappedFile&) = delete;
+
+        ~FONSmappedFile()
+        {
+            close();
+        }
+
+        // Maps 'path', returns false if it cannot be opened or is empty.
+        bool open(const char* path)
+        {
+            close();
+#ifdef _WIN32
+            // Paths are UTF-8, like fons__fopen().
+            wchar_t wpath[MAX_PATH];
+            int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH);
+            if (len == 0) return false;
+            HANDLE file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+            {
+                CloseHandle(file);
+                return false;
+            }
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            CloseHandle(file);
+            if (mapping == nullptr) return false;
+            void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (view == nullptr) return false;
+            data_ = static_cast<unsigned char*>(view);
+            size_ = static_cast<size_t>(size.QuadPart);
+#else
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0)
+            {
+                ::close(fd);
+                return false;
+            }
+            void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (view == MAP_FAILED) return false;
+            data_ = static_cast<unsigned char*>(view);
+            size_ = static_cast<size_t>(st.st_size);
+#endif
+            return true;
+        }
+
+        // Hints that the mapping is read sparsely, as font tables are, so the
+        // OS does not read ahead pages that are never used.
+        void adviseRandom()
+        {
+#ifndef _WIN32
+            if (data_ != nullptr) madvise(data_, size_, MADV_RANDOM);
+#endif
+        }
+
+        void close()
+        {
+            if (data_ == nullptr) return;
+#ifdef _WIN32
+            UnmapViewOfFile(data_);
+#else
+            munmap(data_, size_);
+#endif
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+        const unsigned char* data() const { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        unsigned char* data_;
+        size_t size_;
+    };
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "fontstash/fs_blur.hpp"
+
+namespace fontstash {
+    // A glyph whose atlas rect has been reserved and is waiting for pixels.
+    struct FONSrasterJob {
+        FONSface* face;         // Face owning the glyph outline.
+        int index;              // Glyph index in 'face'.
+        FT_UInt pixels;         // Pixel size passed to FT_Set_Pixel_Sizes.
+        short isize, iblur, pad;
+        int page, x, y, w, h;   // Reserved rect, padding included.
+        unsigned char* dst;     // Top-left of the rect in the page texture.
+        int stride;
+    };
+
+    // Rasterizes batches of glyphs on a fixed set of threads. FreeType objects
+    // must not be shared between threads, so every worker opens its own
+    // FT_Library and its own FT_Face over the font data. The calling thread
+    // works as worker 0 while a batch runs.
+    struct FONSrasterPool {
+        explicit FONSrasterPool(int nthreads) :
+            workers_(maxi(nthreads, 1)),
+            stop_{false},
+            generation_{0},
+            jobs_{nullptr},
+            next_{0},
+            pending_{0}
+        {
+            for (int i = 1; i < (int)workers_.size(); ++i)
+            {
+                threads_.emplace_back(&FONSrasterPool::workerMain, this, i);
+            }
+        }
+
+        ~FONSrasterPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for (std::thread& t : threads_)
+            {
+                t.join();
+            }
+            for (Worker& w : workers_)
+            {
+                if (w.library) FT_Done_FreeType(w.library);
+            }
+        }
+
+        int size() const { return (int)workers_.size(); }
+
+        // Renders all jobs and returns once every job is done.
+        void run(std::vector<FONSrasterJob>& jobs)
+        {
+            if (jobs.empty()) return;
+
+            // Keep jobs of the same face and size together, they share setup.
+            std::sort(jobs.begin(), jobs.end(), [](const FONSrasterJob& a, const FONSrasterJob& b) {
+                return a.face != b.face ? a.face < b.face : a.pixels < b.pixels;
+            });
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                jobs_ = &jobs;
+                next_ = 0;
+                pending_ = (int)threads_.size();
+                generation_++;
+            }
+            wake_.notify_all();
+            process(workers_[0]);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this] { return pending_ == 0; });
+            jobs_ = nullptr;
+        }
+
+        // Copies a rendered bitmap into the rect reserved by 'job' and blurs it.
+        static void writeGlyph(const FT_Bitmap& bitmap, const FONSrasterJob& job)
+        {
+            // The rect was sized from measured metrics, never write outside it.
+            int bw = mini((int)bitmap.width, job.w - job.pad*2);
+            int bh = mini((int)bitmap.rows, job.h - job.pad*2);
+            unsigned char* dst = job.dst + job.pad + job.pad * job.stride;
+            for (int y = 0; y < bh; ++y)
+            {
+                memcpy(&dst[y * job.stride], &bitmap.buffer[y * bitmap.pitch], bw);
+            }
+            if (job.iblur > 0)
+            {
+                blur(job.dst, job.w, job.h, job.stride, job.iblur);
+            }
+        }
+
+    private:
+        struct WorkerFace {
+            const FONSface* source;
+            FT_Face face;
+            FT_UInt pixels;
+        };
+
+        struct Worker {
+            FT_Library library = nullptr;
+            std::vector<WorkerFace> faces;
+        };
+
+        static constexpr size_t CHUNK = 4;
+
+        void workerMain(int i)
+        {
+            unsigned int seen = 0;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                    if (stop_) return;
+                    seen = generation_;
+                }
+                process(workers_[i]);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (--pending_ == 0) done_.notify_one();
+                }
+            }
+        }
+
+        void process(Worker& w)
+        {
+            std::vector<FONSrasterJob>& jobs = *jobs_;
+            for (;;)
+            {
+                size_t first = next_.fetch_add(CHUNK);
+                if (first >= jobs.size()) break;
+                size_t last = std::min(first + CHUNK, jobs.size());
+                for (size_t i = first; i < last; ++i)
+                {
+                    rasterize(w, jobs[i]);
+                }
+            }
+        }
+
+        static WorkerFace* faceFor(Worker& w, const FONSface* source)
+        {
+            for (WorkerFace& f : w.faces)
+            {
+                if (f.source == source) return &f;
+            }
+            if (w.library == nullptr && FT_Init_FreeType(&w.library)) return nullptr;
+            FT_Face face;
+            if (FT_New_Memory_Face(w.library, source->data, source->dataSize, 0, &face)) return nullptr;
+            w.faces.push_back(WorkerFace{source, face, 0});
+            return &w.faces.back();
+        }
+
+        static void rasterize(Worker& w, const FONSrasterJob& job)
+        {
+            WorkerFace* f = faceFor(w, job.face);
+            if (f == nullptr) return;
+            if (f->pixels != job.pixels)
+            {
+                if (FT_Set_Pixel_Sizes(f->face, 0, job.pixels)) return;
+                f->pixels = job.pixels;
+            }
+            if (FT_Load_Glyph(f->face, job.index, FT_LOAD_RENDER)) return;
+            writeGlyph(f->face->glyph->bitmap, job);
+        }
+
+        std::vector<Worker> workers_;
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+        bool stop_;
+        unsigned int generation_;
+        std::vector<FONSrasterJob>* jobs_;
+        std::atomic<size_t> next_;
+        int pending_;
+    };
+}
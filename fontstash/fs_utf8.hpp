@@ -1,5 +1,17 @@
 #pragma once
 
+#if !defined(FONS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#   define FONS_UTF8_SSE2 1
+#   include <emmintrin.h>
+#endif
+#if !defined(FONS_NO_SIMD) && defined(__AVX2__)
+#   define FONS_UTF8_AVX2 1
+#   include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
 namespace fontstash {
     // Copyright (c) 2008-2010 Bjoern Hoehrmann <bjoern@hoehrmann.de>
     // See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
@@ -38,5 +50,160 @@ namespace fontstash {
         *state = utf8d[256 + *state + type];
         return *state;
     }
+
+    // Number of codepoints FONSutf8Reader decodes at a time.
+#ifndef FONS_UTF8_BLOCK
+#   define FONS_UTF8_BLOCK 64
+#endif
+
+    static inline int fons__ctz(unsigned int v)
+    {
+#if defined(_MSC_VER)
+        unsigned long i;
+        _BitScanForward(&i, v);
+        return (int)i;
+#else
+        return __builtin_ctz(v);
+#endif
+    }
+
+    // Widens the ASCII bytes at the start of [s, e) into 'out', at most
+    // 'max' of them, and returns how many. Vectors are stored whole, so
+    // 'out' may be written past the count when the run ends inside one.
+    static inline int fons__widenAscii(const unsigned char* s, const unsigned char* e, unsigned int* out, int max)
+    {
+        int n = 0;
+#if defined(FONS_UTF8_AVX2)
+        while (e - s - n >= 32 && max - n >= 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + n));
+            __m128i lo = _mm256_castsi256_si128(v);
+            __m128i hi = _mm256_extracti128_si256(v, 1);
+            __m256i* o = reinterpret_cast<__m256i*>(out + n);
+            _mm256_storeu_si256(o + 0, _mm256_cvtepu8_epi32(lo));
+            _mm256_storeu_si256(o + 1, _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+            _mm256_storeu_si256(o + 2, _mm256_cvtepu8_epi32(hi));
+            _mm256_storeu_si256(o + 3, _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+            unsigned int mask = (unsigned int)_mm256_movemask_epi8(v);
+            if (mask != 0) return n + fons__ctz(mask);
+            n += 32;
+        }
+#endif
+#if defined(FONS_UTF8_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        while (e - s - n >= 16 && max - n >= 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + n));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            __m128i* o = reinterpret_cast<__m128i*>(out + n);
+            _mm_storeu_si128(o + 0, _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(o + 1, _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(o + 2, _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(o + 3, _mm_unpackhi_epi16(hi, zero));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(v);
+            if (mask != 0) return n + fons__ctz(mask);
+            n += 16;
+        }
+#endif
+        while (s + n != e && n < max && s[n] < 0x80)
+        {
+            out[n] = s[n];
+            n++;
+        }
+        return n;
+    }
+
+    // Decodes [*str, end) into 'out' until 'max' codepoints are written,
+    // continuing from and updating 'state' and 'codep' like decutf8(), and
+    // advances *str past the bytes read. The output is the same as feeding
+    // every byte to decutf8() and keeping the codepoints it accepts: runs of
+    // ASCII are widened a vector at a time, well formed two and three byte
+    // sequences are decoded whole, and anything else goes through the DFA,
+    // which also keeps rejecting the rest of invalid input.
+    // Only the ASCII runs use SSE2/AVX2. Multibyte sequences are checked and
+    // decoded one at a time by scalar code, so CJK text gains less than
+    // Latin text, see bench/utf8.cpp.
+    static int decutf8Block(unsigned int* state, unsigned int* codep, const char** str, const char* end,
+                            unsigned int* out, int max)
+    {
+        const unsigned char* s = reinterpret_cast<const unsigned char*>(*str);
+        const unsigned char* e = reinterpret_cast<const unsigned char*>(end);
+        int n = 0;
+
+        while (s != e && n < max)
+        {
+            unsigned int c = s[0];
+            if (*state != UTF8_ACCEPT)
+            {
+                if (decutf8(state, codep, c) == UTF8_ACCEPT)
+                    out[n++] = *codep;
+                s++;
+            }
+            else if (c < 0x80)
+            {
+                int run = fons__widenAscii(s, e, out + n, max - n);
+                s += run;
+                n += run;
+            }
+            else if (c >= 0xc2 && c <= 0xdf && e - s >= 2 && (s[1] & 0xc0) == 0x80)
+            {
+                out[n++] = ((c & 0x1f) << 6) | (s[1] & 0x3f);
+                s += 2;
+            }
+            // E0 and ED have narrower second bytes, the DFA checks those.
+            else if (c >= 0xe1 && c <= 0xef && c != 0xed && e - s >= 3 &&
+                     (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80)
+            {
+                out[n++] = ((c & 0x0f) << 12) | ((s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+                s += 3;
+            }
+            else
+            {
+                if (decutf8(state, codep, c) == UTF8_ACCEPT)
+                    out[n++] = *codep;
+                s++;
+            }
+        }
+        *str = reinterpret_cast<const char*>(s);
+        return n;
+    }
+
+    // Hands out the codepoints of a string one at a time, decoding them a
+    // block at a time with decutf8Block().
+    struct FONSutf8Reader {
+        FONSutf8Reader(const char* str, const char* end) :
+            str_{str},
+            end_{end},
+            state_{UTF8_ACCEPT},
+            codep_{0},
+            count_{0},
+            next_{0}
+        {
+        }
+
+        bool next(unsigned int* codepoint)
+        {
+            if (next_ == count_)
+            {
+                count_ = 0;
+                next_ = 0;
+                while (count_ == 0 && str_ != end_)
+                    count_ = decutf8Block(&state_, &codep_, &str_, end_, block_, FONS_UTF8_BLOCK);
+                if (count_ == 0) return false;
+            }
+            *codepoint = block_[next_++];
+            return true;
+        }
+
+    private:
+        const char* str_;
+        const char* end_;
+        unsigned int state_;
+        unsigned int codep_;
+        int count_;
+        int next_;
+        unsigned int block_[FONS_UTF8_BLOCK];
+    };
 }
 
@@ -16,15 +16,9 @@
 // 3. This notice may not be removed or altered from any source distribution.
 //
 #pragma once
-
-FONS_DEF FONScontext* glfonsCreate(int width, int height, int flags);
-FONS_DEF void glfonsDelete(FONScontext* ctx);
-
-FONS_DEF unsigned int glfonsRGBA(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
-
-
-
-#ifdef GLFONTSTASH_IMPLEMENTATION
+#include <cstddef>
+#include <cstring>
+#include <vector>
 
 #ifndef GLFONS_VERTEX_ATTRIB
 #	define GLFONS_VERTEX_ATTRIB 0
@@ -38,173 +32,618 @@ FONS_DEF unsigned int glfonsRGBA(unsigned char r, unsigned char g, unsigned char
 #	define GLFONS_COLOR_ATTRIB 2
 #endif
 
-struct GLFONScontext : public FONSparams {
-    GLFONScontext(int w, int h, unsigned char f) :
-        FONSparams{w, h, f},
-        tex{0},
-
-    {
+// Constant attribute holding the y direction of instanced quads, +1 or -1.
+#ifndef GLFONS_YDIR_ATTRIB
+#	define GLFONS_YDIR_ATTRIB 3
+#endif
 
-    }
-    static int renderCreate(int width, int height)
-    {
+// Size in bytes of the persistently mapped vertex ring, used when the driver
+// has GL 4.4 or ARB_buffer_storage. Define GLFONS_NO_PERSISTENT_MAPPING to
+// always upload with glBufferData instead.
+#ifndef GLFONS_RING_SIZE
+#	define GLFONS_RING_SIZE (4 << 20)
+#endif
 
-        // Create may be called multiple times, delete existing texture.
-        if (tex != 0)
+#define GLFONS_STR_(x) #x
+#define GLFONS_STR(x) GLFONS_STR_(x)
+
+namespace fontstash {
+    // Vertex shader for FONS_INSTANCED_QUADS. Each instance is a FONSinstance
+    // drawn as a 4 vertex strip, the corner comes from gl_VertexID. Set the
+    // 'projection' uniform and bind the atlas to 'atlas' on texture unit 0,
+    // 'color' is normalized.
+    static const char* const GLFONS_INSTANCE_VERTEX_SHADER =
+        "#version 330 core\n"
+        "layout(location = " GLFONS_STR(GLFONS_VERTEX_ATTRIB) ") in ivec2 fonsPosition;\n"
+        "layout(location = " GLFONS_STR(GLFONS_TCOORD_ATTRIB) ") in uvec4 fonsRect;\n"
+        "layout(location = " GLFONS_STR(GLFONS_COLOR_ATTRIB) ") in vec4 fonsColor;\n"
+        "layout(location = " GLFONS_STR(GLFONS_YDIR_ATTRIB) ") in float fonsYDir;\n"
+        "uniform mat4 projection;\n"
+        "uniform sampler2D atlas;\n"
+        "out vec2 uv;\n"
+        "out vec4 color;\n"
+        "void main() {\n"
+        "    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+        "    vec2 size = vec2(fonsRect.zw) - vec2(fonsRect.xy);\n"
+        "    vec2 pos = vec2(fonsPosition) + corner * size * vec2(1.0, fonsYDir);\n"
+        "    uv = (vec2(fonsRect.xy) + corner * size) / vec2(textureSize(atlas, 0));\n"
+        "    color = fonsColor;\n"
+        "    gl_Position = projection * vec4(pos, 0.0, 1.0);\n"
+        "}\n";
+
+    // OpenGL 3 core backend. The caller binds a shader reading position,
+    // texture coordinates and color from the GLFONS_*_ATTRIB locations, the
+    // atlas is swizzled so it samples as (1,1,1,coverage).
+    //
+    // Where persistent mapping is available, vertices go through a ring
+    // buffer that stays mapped. fontstash writes vertices straight into it
+    // through the vertex sink, other draws copy into it, and nothing is
+    // reallocated per draw. The ring is split into sections, a fence is set
+    // when writing leaves a section and waited on before writing enters it
+    // again, so the GPU is never read from memory being overwritten.
+    struct GLFONScontext : FONSparams {
+        GLFONScontext(int w, int h, unsigned char f) :
+            FONSparams{w, h, f},
+            tex{0},
+            vertexArray{0},
+            vertexBuffer{0},
+            tcoordBuffer{0},
+            colorBuffer{0},
+            indexBuffer{0},
+            nindexQuads{0},
+            instanceArray{0},
+            instanceBuffer{0},
+            ringBuffer{0},
+            ringData{nullptr},
+            ringHead{0},
+            ringSection{0},
+            ringFences{},
+            sinkOffset{0},
+            pixelBuffers{0, 0},
+            pixelBuffer{0}
         {
-            glDeleteTextures(1, &tex);
-            tex = 0;
         }
 
-        glGenTextures(1, &tex);
-        if (!tex) return 0;
+        virtual ~GLFONScontext() = default;
 
-        if (!vertexArray) glGenVertexArrays(1, &vertexArray);
-        if (!vertexArray) return 0;
+        virtual int renderCreate(int w, int h)
+        {
+            // Create may be called multiple times, delete existing texture.
+            if (tex != 0)
+            {
+                glDeleteTextures(1, &tex);
+                tex = 0;
+            }
 
-        glBindVertexArray(vertexArray);
+            if (!vertexArray) glGenVertexArrays(1, &vertexArray);
+            if (!vertexArray) return 0;
 
-        if (!vertexBuffer) glGenBuffers(1, &vertexBuffer);
-        if (!vertexBuffer) return 0;
+            glBindVertexArray(vertexArray);
 
-        if (!tcoordBuffer) glGenBuffers(1, &tcoordBuffer);
-        if (!tcoordBuffer) return 0;
+            if (!vertexBuffer) glGenBuffers(1, &vertexBuffer);
+            if (!vertexBuffer) return 0;
 
-        if (!colorBuffer) glGenBuffers(1, &colorBuffer);
-        if (!colorBuffer) return 0;
+            if (!tcoordBuffer) glGenBuffers(1, &tcoordBuffer);
+            if (!tcoordBuffer) return 0;
 
-        width = width;
-        height = height;
-        glBindTexture(GL_TEXTURE_2D, tex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        static GLint swizzleRgbaParams[4] = {GL_ONE, GL_ONE, GL_ONE, GL_RED};
-        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzleRgbaParams);
+            if (!colorBuffer) glGenBuffers(1, &colorBuffer);
+            if (!colorBuffer) return 0;
 
-        return 1;
-    }
+            glBindVertexArray(0);
 
-    static int renderResize(int width, int height)
-    {
-        // Reuse create to resize too.
-        return renderCreate(userPtr, width, height);
-    }
+            if (!ringBuffer) createRing();
 
-    void renderUpdate(int* rect, const unsigned char* data)
-    {
-        int w = rect[2] - rect[0];
-        int h = rect[3] - rect[1];
+            width = w;
+            height = h;
+            return createPageTexture(tex);
+        }
+
+        virtual int renderResize(int width, int height)
+        {
+            // Reuse create to resize too.
+            if (!renderCreate(width, height)) return 0;
+            for (size_t i = 0; i < pages.size(); ++i)
+            {
+                if (!createPageTexture(pages[i])) return 0;
+            }
+            return 1;
+        }
 
-        if (tex == 0) return;
+        virtual int renderAddPage(int page)
+        {
+            // Extra pages are separate textures, page 0 is 'tex'.
+            if (page != (int)pages.size() + 1) return 0;
+            GLuint t = 0;
+            if (!createPageTexture(t)) return 0;
+            pages.push_back(t);
+            return 1;
+        }
+
+        virtual void renderUpdate(int* rect, const unsigned char* data)
+        {
+            renderUpdatePage(0, rect, data);
+        }
 
-        // Push old values
-        GLint alignment, rowLength, skipPixels, skipRows;
-        glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
-        glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rowLength);
-        glGetIntegerv(GL_UNPACK_SKIP_PIXELS, &skipPixels);
-        glGetIntegerv(GL_UNPACK_SKIP_ROWS, &skipRows);
+        virtual void renderUpdatePage(int page, int* rect, const unsigned char* data)
+        {
+            renderUpdateRects(page, rect, 1, data);
+        }
+
+        virtual void renderUpdateRects(int page, const int* rects, int nrects, const unsigned char* data)
+        {
+            GLuint t = pageTexture(page);
+
+            if (t == 0) return;
+
+            // Push old values
+            GLint alignment, rowLength, skipPixels, skipRows;
+            glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+            glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rowLength);
+            glGetIntegerv(GL_UNPACK_SKIP_PIXELS, &skipPixels);
+            glGetIntegerv(GL_UNPACK_SKIP_ROWS, &skipRows);
+
+            glBindTexture(GL_TEXTURE_2D, t);
+
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            if (!(flags & FONS_ASYNC_UPLOADS) || !uploadRects(rects, nrects, data))
+            {
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+                for (int i = 0; i < nrects; ++i)
+                {
+                    const int* rect = &rects[i*4];
+                    glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect[0]);
+                    glPixelStorei(GL_UNPACK_SKIP_ROWS, rect[1]);
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], rect[2] - rect[0], rect[3] - rect[1], GL_RED, GL_UNSIGNED_BYTE, data);
+                }
+            }
+
+            // Pop old values
+            glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, skipPixels);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, skipRows);
+        }
 
-        glBindTexture(GL_TEXTURE_2D, tex);
+        // Packs the rects into the next pixel buffer and uploads the texture
+        // from it, the call returns before the GPU has the pixels. The two
+        // buffers alternate and are respecified before mapping, so writing
+        // never waits for the previous upload to finish.
+        bool uploadRects(const int* rects, int nrects, const unsigned char* data)
+        {
+            size_t size = 0;
+            for (int i = 0; i < nrects; ++i)
+            {
+                const int* rect = &rects[i*4];
+                size += (size_t)(rect[2] - rect[0]) * (rect[3] - rect[1]);
+            }
+            if (size == 0) return true;
+
+            GLuint& pbo = pixelBuffers[pixelBuffer];
+            if (!pbo) glGenBuffers(1, &pbo);
+            if (!pbo) return false;
+            pixelBuffer ^= 1;
+
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+            unsigned char* dst = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            if (dst == nullptr)
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return false;
+            }
+            for (int i = 0; i < nrects; ++i)
+            {
+                const int* rect = &rects[i*4];
+                int w = rect[2] - rect[0];
+                for (int y = rect[1]; y < rect[3]; ++y)
+                {
+                    memcpy(dst, &data[y * width + rect[0]], w);
+                    dst += w;
+                }
+            }
+            // The contents are undefined if unmapping fails, upload directly.
+            if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return false;
+            }
+
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+            size_t offset = 0;
+            for (int i = 0; i < nrects; ++i)
+            {
+                const int* rect = &rects[i*4];
+                int w = rect[2] - rect[0], h = rect[3] - rect[1];
+                glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], w, h, GL_RED, GL_UNSIGNED_BYTE, (const void*)offset);
+                offset += (size_t)w * h;
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return true;
+        }
 
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
-        glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect[0]);
-        glPixelStorei(GL_UNPACK_SKIP_ROWS, rect[1]);
+        virtual void renderDraw(const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            renderDrawPage(0, verts, tcoords, colors, nverts);
+        }
 
-        glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], w, h, GL_RED, GL_UNSIGNED_BYTE, data);
+        virtual void renderDrawPage(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            if (!bindArrays(page, verts, tcoords, colors, nverts)) return;
+            glDrawArrays(GL_TRIANGLES, 0, nverts);
+            unbindArrays();
+        }
 
-        // Pop old values
-        glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
-        glPixelStorei(GL_UNPACK_SKIP_PIXELS, skipPixels);
-        glPixelStorei(GL_UNPACK_SKIP_ROWS, skipRows);
-    }
+        virtual void renderDrawIndexed(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            int nquads = nverts / 4;
+            if (!bindArrays(page, verts, tcoords, colors, nverts)) return;
+            if (bindIndices(nquads))
+                glDrawElements(GL_TRIANGLES, nquads * 6, GL_UNSIGNED_SHORT, nullptr);
+            unbindArrays();
+        }
 
-    void renderDraw(const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
-    {
-        if (tex == 0 || vertexArray == 0) return;
+        virtual void renderDrawInstanced(int page, const FONSinstance* instances, int ninstances)
+        {
+            GLuint t = pageTexture(page);
+            size_t bytes = ninstances * sizeof(FONSinstance);
+            if (t == 0 || !bindInstances()) return;
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, t);
+
+            if (ringData != nullptr && bytes <= ringLimit())
+            {
+                size_t offset = ringReserve(bytes);
+                memcpy(ringData + offset, instances, bytes);
+                ringHead = offset + bytes;
+                setInstancePointers(ringBuffer, offset);
+            }
+            else
+            {
+                setInstancePointers(instanceBuffer, 0);
+                glBufferData(GL_ARRAY_BUFFER, bytes, instances, GL_STREAM_DRAW);
+            }
+            glVertexAttrib1f(GLFONS_YDIR_ATTRIB, (flags & FONS_ZERO_TOPLEFT) ? 1.0f : -1.0f);
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, ninstances);
+
+            glBindVertexArray(0);
+        }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, tex);
+        // Hands out the next stretch of the ring, vertices are written there
+        // in place. Without a ring the context falls back to its arrays.
+        virtual FONSvertex* renderMapVertices(int page, int minVerts, int* capacity)
+        {
+            (void)page;
+            (void)minVerts;
+            // One section at a time, however much is asked for, and 16-bit
+            // quad indices address at most 65536 vertices.
+            int cap = mini((int)(GLFONS_RING_SIZE / RING_SECTIONS / sizeof(FONSvertex)), 65536);
+            if (ringData == nullptr)
+            {
+                *capacity = 0;
+                return nullptr;
+            }
+            sinkOffset = ringReserve(cap * sizeof(FONSvertex));
+            *capacity = cap;
+            return reinterpret_cast<FONSvertex*>(ringData + sinkOffset);
+        }
 
-        glBindVertexArray(vertexArray);
+        virtual void renderDrawVertices(int page, int nverts)
+        {
+            // Only what was written is used up.
+            ringHead = sinkOffset + nverts * sizeof(FONSvertex);
+            if (nverts == 0) return;
+
+            GLuint t = pageTexture(page);
+            if (t == 0 || vertexArray == 0) return;
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, t);
+            glBindVertexArray(vertexArray);
+            GLsizei stride = sizeof(FONSvertex);
+            setVertexPointers(ringBuffer, sinkOffset + offsetof(FONSvertex, x), stride,
+                              sinkOffset + offsetof(FONSvertex, s), stride,
+                              sinkOffset + offsetof(FONSvertex, c), stride);
+            if (!(flags & FONS_INDEXED_QUADS))
+                glDrawArrays(GL_TRIANGLES, 0, nverts);
+            else if (bindIndices(nverts / 4))
+                glDrawElements(GL_TRIANGLES, nverts / 4 * 6, GL_UNSIGNED_SHORT, nullptr);
+            unbindArrays();
+        }
 
-        glEnableVertexAttribArray(GLFONS_VERTEX_ATTRIB);
-        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-        glBufferData(GL_ARRAY_BUFFER, nverts * 2 * sizeof(float), verts, GL_DYNAMIC_DRAW);
-        glVertexAttribPointer(GLFONS_VERTEX_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        virtual void renderDelete()
+        {
+            if (tex != 0)
+            {
+                glDeleteTextures(1, &tex);
+                tex = 0;
+            }
+            for (GLuint t : pages)
+            {
+                glDeleteTextures(1, &t);
+            }
+            pages.clear();
+
+            glBindVertexArray(0);
+
+            GLuint* buffers[] = {&vertexBuffer, &tcoordBuffer, &colorBuffer, &indexBuffer, &instanceBuffer,
+                                 &pixelBuffers[0], &pixelBuffers[1]};
+            for (GLuint* b : buffers)
+            {
+                if (*b != 0)
+                {
+                    glDeleteBuffers(1, b);
+                    *b = 0;
+                }
+            }
+            nindexQuads = 0;
+
+            // Deleting the ring unmaps it.
+            for (GLsync& fence : ringFences)
+            {
+                if (fence != nullptr) glDeleteSync(fence);
+                fence = nullptr;
+            }
+            if (ringBuffer != 0)
+            {
+                glDeleteBuffers(1, &ringBuffer);
+                ringBuffer = 0;
+            }
+            ringData = nullptr;
+            ringHead = 0;
+            ringSection = 0;
+
+            GLuint* arrays[] = {&vertexArray, &instanceArray};
+            for (GLuint* a : arrays)
+            {
+                if (*a != 0)
+                {
+                    glDeleteVertexArrays(1, a);
+                    *a = 0;
+                }
+            }
+        }
 
-        glEnableVertexAttribArray(GLFONS_TCOORD_ATTRIB);
-        glBindBuffer(GL_ARRAY_BUFFER, tcoordBuffer);
-        glBufferData(GL_ARRAY_BUFFER, nverts * 2 * sizeof(float), tcoords, GL_DYNAMIC_DRAW);
-        glVertexAttribPointer(GLFONS_TCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        GLuint pageTexture(int page) const
+        {
+            if (page == 0) return tex;
+            if (page < 1 || page > (int)pages.size()) return 0;
+            return pages[page-1];
+        }
 
-        glEnableVertexAttribArray(GLFONS_COLOR_ATTRIB);
-        glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-        glBufferData(GL_ARRAY_BUFFER, nverts * sizeof(unsigned int), colors, GL_DYNAMIC_DRAW);
-        glVertexAttribPointer(GLFONS_COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, NULL);
+        int createPageTexture(GLuint& t)
+        {
+            static const GLint swizzleRgbaParams[4] = {GL_ONE, GL_ONE, GL_ONE, GL_RED};
+            if (t != 0) glDeleteTextures(1, &t);
+            glGenTextures(1, &t);
+            if (!t) return 0;
+            glBindTexture(GL_TEXTURE_2D, t);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzleRgbaParams);
+            return 1;
+        }
 
-        glDrawArrays(GL_TRIANGLES, 0, nverts);
+        // Uploads the vertex arrays and leaves the vertex array object bound.
+        bool bindArrays(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            GLuint t = pageTexture(page);
+            if (t == 0 || vertexArray == 0) return false;
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, t);
+
+            glBindVertexArray(vertexArray);
+
+            size_t vbytes = nverts * 2 * sizeof(float);
+            size_t cbytes = nverts * sizeof(unsigned int);
+            if (ringData != nullptr && vbytes * 2 + cbytes <= ringLimit())
+            {
+                // The three arrays back to back in the ring.
+                size_t offset = ringReserve(vbytes * 2 + cbytes);
+                memcpy(ringData + offset, verts, vbytes);
+                memcpy(ringData + offset + vbytes, tcoords, vbytes);
+                memcpy(ringData + offset + vbytes * 2, colors, cbytes);
+                ringHead = offset + vbytes * 2 + cbytes;
+                setVertexPointers(ringBuffer, offset, 0, offset + vbytes, 0, offset + vbytes * 2, 0);
+                return true;
+            }
+
+            glEnableVertexAttribArray(GLFONS_VERTEX_ATTRIB);
+            glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, vbytes, verts, GL_DYNAMIC_DRAW);
+            glVertexAttribPointer(GLFONS_VERTEX_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+            glEnableVertexAttribArray(GLFONS_TCOORD_ATTRIB);
+            glBindBuffer(GL_ARRAY_BUFFER, tcoordBuffer);
+            glBufferData(GL_ARRAY_BUFFER, vbytes, tcoords, GL_DYNAMIC_DRAW);
+            glVertexAttribPointer(GLFONS_TCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+            glEnableVertexAttribArray(GLFONS_COLOR_ATTRIB);
+            glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+            glBufferData(GL_ARRAY_BUFFER, cbytes, colors, GL_DYNAMIC_DRAW);
+            glVertexAttribPointer(GLFONS_COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, nullptr);
+            return true;
+        }
 
-        glDisableVertexAttribArray(GLFONS_VERTEX_ATTRIB);
-        glDisableVertexAttribArray(GLFONS_TCOORD_ATTRIB);
-        glDisableVertexAttribArray(GLFONS_COLOR_ATTRIB);
+        // Points the vertex attributes at byte offsets in 'buffer'.
+        void setVertexPointers(GLuint buffer, size_t voffset, GLsizei vstride, size_t toffset, GLsizei tstride,
+                               size_t coffset, GLsizei cstride)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            glEnableVertexAttribArray(GLFONS_VERTEX_ATTRIB);
+            glVertexAttribPointer(GLFONS_VERTEX_ATTRIB, 2, GL_FLOAT, GL_FALSE, vstride, (const void*)voffset);
+            glEnableVertexAttribArray(GLFONS_TCOORD_ATTRIB);
+            glVertexAttribPointer(GLFONS_TCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, tstride, (const void*)toffset);
+            glEnableVertexAttribArray(GLFONS_COLOR_ATTRIB);
+            glVertexAttribPointer(GLFONS_COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_FALSE, cstride, (const void*)coffset);
+        }
 
-        glBindVertexArray(0);
-    }
+        void unbindArrays()
+        {
+            glDisableVertexAttribArray(GLFONS_VERTEX_ATTRIB);
+            glDisableVertexAttribArray(GLFONS_TCOORD_ATTRIB);
+            glDisableVertexAttribArray(GLFONS_COLOR_ATTRIB);
 
-    void renderDelete(void* userPtr)
-    {
-        GLFONScontext* gl = (GLFONScontext*)userPtr;
-        if (tex != 0) {
-            glDeleteTextures(1, &tex);
-            tex = 0;
+            glBindVertexArray(0);
         }
 
-        glBindVertexArray(0);
+        // Binds the static quad index buffer to the bound vertex array object,
+        // it is filled once and only rebuilt when a batch outgrows it.
+        bool bindIndices(int nquads)
+        {
+            if (!indexBuffer) glGenBuffers(1, &indexBuffer);
+            if (!indexBuffer) return false;
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            if (nquads > nindexQuads)
+            {
+                nindexQuads = maxi(nquads, FONS_VERTEX_COUNT / 4);
+                std::vector<unsigned short> indices(nindexQuads * 6);
+                fonsQuadIndices(indices.data(), nindexQuads);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), indices.data(), GL_STATIC_DRAW);
+            }
+            return true;
+        }
 
-        if (vertexBuffer != 0) {
-            glDeleteBuffers(1, &vertexBuffer);
-            vertexBuffer = 0;
+        // Binds the vertex array object of instanced draws.
+        bool bindInstances()
+        {
+            if (!instanceArray) glGenVertexArrays(1, &instanceArray);
+            if (!instanceArray) return false;
+            if (!instanceBuffer) glGenBuffers(1, &instanceBuffer);
+            if (!instanceBuffer) return false;
+            glBindVertexArray(instanceArray);
+            return true;
         }
 
-        if (tcoordBuffer != 0) {
-            glDeleteBuffers(1, &tcoordBuffer);
-            tcoordBuffer = 0;
+        // Points the per-instance attributes at FONSinstance records starting
+        // at byte 'base' of 'buffer'.
+        void setInstancePointers(GLuint buffer, size_t base)
+        {
+            GLsizei stride = sizeof(FONSinstance);
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            glEnableVertexAttribArray(GLFONS_VERTEX_ATTRIB);
+            glVertexAttribIPointer(GLFONS_VERTEX_ATTRIB, 2, GL_SHORT, stride, (const void*)(base + offsetof(FONSinstance, x)));
+            glVertexAttribDivisor(GLFONS_VERTEX_ATTRIB, 1);
+            glEnableVertexAttribArray(GLFONS_TCOORD_ATTRIB);
+            glVertexAttribIPointer(GLFONS_TCOORD_ATTRIB, 4, GL_UNSIGNED_SHORT, stride, (const void*)(base + offsetof(FONSinstance, u0)));
+            glVertexAttribDivisor(GLFONS_TCOORD_ATTRIB, 1);
+            glEnableVertexAttribArray(GLFONS_COLOR_ATTRIB);
+            glVertexAttribPointer(GLFONS_COLOR_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, (const void*)(base + offsetof(FONSinstance, c)));
+            glVertexAttribDivisor(GLFONS_COLOR_ATTRIB, 1);
         }
 
-        if (colorBuffer != 0) {
-            glDeleteBuffers(1, &colorBuffer);
-            colorBuffer = 0;
+        static constexpr int RING_SECTIONS = 4;
+
+        // Creates and maps the ring if the driver can keep buffers mapped.
+        void createRing()
+        {
+#if defined(GL_MAP_PERSISTENT_BIT) && !defined(GLFONS_NO_PERSISTENT_MAPPING)
+            GLint major = 0, minor = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            bool supported = major > 4 || (major == 4 && minor >= 4);
+            GLint nextensions = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &nextensions);
+            for (GLint i = 0; i < nextensions && !supported; ++i)
+            {
+                const char* name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+                supported = name != nullptr && strcmp(name, "GL_ARB_buffer_storage") == 0;
+            }
+            if (!supported) return;
+
+            GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glGenBuffers(1, &ringBuffer);
+            if (!ringBuffer) return;
+            glBindBuffer(GL_ARRAY_BUFFER, ringBuffer);
+            glBufferStorage(GL_ARRAY_BUFFER, GLFONS_RING_SIZE, nullptr, access);
+            ringData = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, GLFONS_RING_SIZE, access);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            if (ringData == nullptr)
+            {
+                glDeleteBuffers(1, &ringBuffer);
+                ringBuffer = 0;
+            }
+#endif
         }
 
-        if (vertexArray != 0) {
-            glDeleteVertexArrays(1, &vertexArray);
-            vertexArray = 0;
+        // Largest single reservation, half the ring so a reservation never
+        // wraps onto the section being written.
+        static size_t ringLimit()
+        {
+            return GLFONS_RING_SIZE / 2;
         }
-    }
-	GLuint tex;
-	GLuint vertexArray;
-	GLuint vertexBuffer;
-	GLuint tcoordBuffer;
-	GLuint colorBuffer;
-};
 
+        // Returns the offset of 'bytes' free bytes in the ring, waiting for the
+        // GPU to finish with them first. Set 'ringHead' past what was used.
+        size_t ringReserve(size_t bytes)
+        {
+            const size_t sectionSize = GLFONS_RING_SIZE / RING_SECTIONS;
+            size_t offset = (ringHead + 15) & ~(size_t)15;
+            if (offset + bytes > GLFONS_RING_SIZE) offset = 0;
+
+            // Walk the sections up to the last one the range touches, wrapping
+            // around with the range. Reservations are at most half the ring,
+            // so a wrapped range never ends in the section being left.
+            int last = (int)((offset + bytes - 1) / sectionSize);
+            while (ringSection != last)
+            {
+                ringFences[ringSection] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                ringSection = (ringSection + 1) % RING_SECTIONS;
+                waitSection(ringSection);
+            }
+            return offset;
+        }
 
+        void waitSection(int section)
+        {
+            GLsync& fence = ringFences[section];
+            if (fence == nullptr) return;
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            {
+            }
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
 
-inline FONScontext* glfonsCreate(int width, int height, int flags)
-{
-    GLFONScontext *gl = new GLFONScontext(width, height, flags);
-	return new FONScontext(gl);
-}
+        GLuint tex;
+        // Textures of atlas pages 1..n.
+        std::vector<GLuint> pages;
+        GLuint vertexArray;
+        GLuint vertexBuffer;
+        GLuint tcoordBuffer;
+        GLuint colorBuffer;
+        GLuint indexBuffer;
+        int nindexQuads;
+        GLuint instanceArray;
+        GLuint instanceBuffer;
+        GLuint ringBuffer;
+        unsigned char* ringData;    // Persistent mapping of 'ringBuffer', or null.
+        size_t ringHead;            // First byte after the last reservation used.
+        int ringSection;            // Section being written.
+        GLsync ringFences[RING_SECTIONS];
+        size_t sinkOffset;
+        // Staging buffers of FONS_ASYNC_UPLOADS, used in turn.
+        GLuint pixelBuffers[2];
+        int pixelBuffer;
+    };
+
+
+    inline FONScontext* glfonsCreate(int width, int height, int flags)
+    {
+        GLFONScontext *params = new GLFONScontext(width, height, flags);
+        return new FONScontext(params);
+    }
 
-inline void glfonsDelete(FONScontext* ctx)
-{
-	delete ctx;
-}
+    inline void glfonsDelete(FONScontext* ctx)
+    {
+        delete ctx;
+    }
 
-inline unsigned int glfonsRGBA(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
-{
-	return (r) | (g << 8) | (b << 16) | (a << 24);
+    inline unsigned int glfonsRGBA(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+    {
+        return (r) | (g << 8) | (b << 16) | (a << 24);
+    }
 }
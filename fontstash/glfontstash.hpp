@@ -16,12 +16,21 @@
 // 3. This notice may not be removed or altered from any source distribution.
 //
 #pragma once
+#include <cstring>
+#include <vector>
+
+// FONS_ASYNC_UPLOADS stages atlas updates in pixel buffer objects, which need
+// GL 2.1 or ARB_pixel_buffer_object. Define GLFONS_PIXEL_BUFFERS when those
+// entry points are declared, e.g. by a loader or GL_GLEXT_PROTOTYPES. Without
+// it this backend sticks to GL 1.1 and uploads with glTexSubImage2D.
 
 namespace fontstash {
     struct GLFONScontext : FONSparams {
         GLFONScontext(int w, int h, unsigned char f) :
             FONSparams{w, h, f},
-            tex{0}
+            tex{0},
+            pixelBuffers{0, 0},
+            pixelBuffer{0}
         {
         }
 
@@ -47,39 +56,180 @@ namespace fontstash {
         virtual int renderResize(int width, int height)
         {
             // Reuse create to resize too.
-            return renderCreate(width, height);
+            if (!renderCreate(width, height)) return 0;
+            for (size_t i = 0; i < pages.size(); ++i)
+            {
+                if (!createPageTexture(pages[i])) return 0;
+            }
+            return 1;
+        }
+
+        virtual int renderAddPage(int page)
+        {
+            // Extra pages are separate textures, page 0 is 'tex'.
+            if (page != (int)pages.size() + 1) return 0;
+            GLuint t = 0;
+            if (!createPageTexture(t)) return 0;
+            pages.push_back(t);
+            return 1;
         }
 
         virtual void renderUpdate(int* rect, const unsigned char* data)
         {
-            int w = rect[2] - rect[0];
-            int h = rect[3] - rect[1];
+            renderUpdatePage(0, rect, data);
+        }
 
-            if (tex == 0) return;
+        virtual void renderUpdatePage(int page, int* rect, const unsigned char* data)
+        {
+            renderUpdateRects(page, rect, 1, data);
+        }
+
+        virtual void renderUpdateRects(int page, const int* rects, int nrects, const unsigned char* data)
+        {
+            GLuint t = pageTexture(page);
+
+            if (t == 0) return;
             glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
-            glBindTexture(GL_TEXTURE_2D, tex);
+            glBindTexture(GL_TEXTURE_2D, t);
             glPixelStorei(GL_UNPACK_ALIGNMENT,1);
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
-            glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect[0]);
-            glPixelStorei(GL_UNPACK_SKIP_ROWS, rect[1]);
-            glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], w, h, GL_ALPHA,GL_UNSIGNED_BYTE, data);
+#ifdef GLFONS_PIXEL_BUFFERS
+            if (!(flags & FONS_ASYNC_UPLOADS) || !uploadRects(rects, nrects, data))
+#endif
+            {
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+                for (int i = 0; i < nrects; ++i)
+                {
+                    const int* rect = &rects[i*4];
+                    glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect[0]);
+                    glPixelStorei(GL_UNPACK_SKIP_ROWS, rect[1]);
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], rect[2] - rect[0], rect[3] - rect[1], GL_ALPHA, GL_UNSIGNED_BYTE, data);
+                }
+            }
             glPopClientAttrib();
         }
 
+#ifdef GLFONS_PIXEL_BUFFERS
+        // Packs the rects into the next pixel buffer and uploads the texture
+        // from it, the call returns before the GPU has the pixels. The two
+        // buffers alternate and are respecified before mapping, so writing
+        // never waits for the previous upload to finish.
+        bool uploadRects(const int* rects, int nrects, const unsigned char* data)
+        {
+            size_t size = 0;
+            for (int i = 0; i < nrects; ++i)
+            {
+                const int* rect = &rects[i*4];
+                size += (size_t)(rect[2] - rect[0]) * (rect[3] - rect[1]);
+            }
+            if (size == 0) return true;
+
+            GLuint& pbo = pixelBuffers[pixelBuffer];
+            if (!pbo) glGenBuffers(1, &pbo);
+            if (!pbo) return false;
+            pixelBuffer ^= 1;
+
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+            unsigned char* dst = (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+            if (dst == nullptr)
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return false;
+            }
+            for (int i = 0; i < nrects; ++i)
+            {
+                const int* rect = &rects[i*4];
+                int w = rect[2] - rect[0];
+                for (int y = rect[1]; y < rect[3]; ++y)
+                {
+                    memcpy(dst, &data[y * width + rect[0]], w);
+                    dst += w;
+                }
+            }
+            // The contents are undefined if unmapping fails, upload directly.
+            if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                return false;
+            }
+
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+            glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+            size_t offset = 0;
+            for (int i = 0; i < nrects; ++i)
+            {
+                const int* rect = &rects[i*4];
+                int w = rect[2] - rect[0], h = rect[3] - rect[1];
+                glTexSubImage2D(GL_TEXTURE_2D, 0, rect[0], rect[1], w, h, GL_ALPHA, GL_UNSIGNED_BYTE, (const void*)offset);
+                offset += (size_t)w * h;
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return true;
+        }
+#endif
+
         virtual void renderDraw(const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
         {
-            if (tex == 0) return;
-            glBindTexture(GL_TEXTURE_2D, tex);
+            renderDrawPage(0, verts, tcoords, colors, nverts);
+        }
+
+        virtual void renderDrawPage(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            drawArrays(page, verts, sizeof(float)*2, tcoords, sizeof(float)*2, colors, sizeof(unsigned int), nverts, false);
+        }
+
+        virtual void renderDrawIndexed(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            drawArrays(page, verts, sizeof(float)*2, tcoords, sizeof(float)*2, colors, sizeof(unsigned int), nverts, true);
+        }
+
+        // Client arrays are plain memory, so fontstash writes interleaved
+        // vertices straight into the array GL reads from. The array grows to
+        // whatever the context asks for.
+        virtual FONSvertex* renderMapVertices(int page, int minVerts, int* capacity)
+        {
+            (void)page;
+            if ((int)vertices.size() < minVerts) vertices.resize(minVerts);
+            if ((int)vertices.size() < FONS_VERTEX_COUNT) vertices.resize(FONS_VERTEX_COUNT);
+            *capacity = (int)vertices.size();
+            return vertices.data();
+        }
+
+        virtual void renderDrawVertices(int page, int nverts)
+        {
+            if (nverts == 0) return;
+            const FONSvertex* v = vertices.data();
+            drawArrays(page, &v->x, sizeof(FONSvertex), &v->s, sizeof(FONSvertex), &v->c, sizeof(FONSvertex), nverts,
+                       (flags & FONS_INDEXED_QUADS) != 0);
+        }
+
+        void drawArrays(int page, const float* verts, GLsizei vstride, const float* tcoords, GLsizei tstride,
+                        const unsigned int* colors, GLsizei cstride, int nverts, bool indexed)
+        {
+            GLuint t = pageTexture(page);
+            if (t == 0) return;
+            // Indices are shared by every batch and only grow.
+            int nquads = nverts / 4;
+            if (indexed && (int)indices.size() < nquads * 6)
+            {
+                indices.resize(nquads * 6);
+                fonsQuadIndices(indices.data(), nquads);
+            }
+            glBindTexture(GL_TEXTURE_2D, t);
             glEnable(GL_TEXTURE_2D);
             glEnableClientState(GL_VERTEX_ARRAY);
             glEnableClientState(GL_TEXTURE_COORD_ARRAY);
             glEnableClientState(GL_COLOR_ARRAY);
 
-            glVertexPointer(2, GL_FLOAT, sizeof(float)*2, verts);
-            glTexCoordPointer(2, GL_FLOAT, sizeof(float)*2, tcoords);
-            glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(unsigned int), colors);
+            glVertexPointer(2, GL_FLOAT, vstride, verts);
+            glTexCoordPointer(2, GL_FLOAT, tstride, tcoords);
+            glColorPointer(4, GL_UNSIGNED_BYTE, cstride, colors);
 
-            glDrawArrays(GL_TRIANGLES, 0, nverts);
+            if (indexed)
+                glDrawElements(GL_TRIANGLES, nquads * 6, GL_UNSIGNED_SHORT, indices.data());
+            else
+                glDrawArrays(GL_TRIANGLES, 0, nverts);
 
             glDisable(GL_TEXTURE_2D);
             glDisableClientState(GL_VERTEX_ARRAY);
@@ -94,8 +244,48 @@ namespace fontstash {
                 glDeleteTextures(1, &tex);
             }
             tex = 0;
+            for (GLuint t : pages)
+            {
+                glDeleteTextures(1, &t);
+            }
+            pages.clear();
+#ifdef GLFONS_PIXEL_BUFFERS
+            for (GLuint& b : pixelBuffers)
+            {
+                if (b != 0) glDeleteBuffers(1, &b);
+                b = 0;
+            }
+#endif
+        }
+
+        GLuint pageTexture(int page) const
+        {
+            if (page == 0) return tex;
+            if (page < 1 || page > (int)pages.size()) return 0;
+            return pages[page-1];
+        }
+
+        int createPageTexture(GLuint& t)
+        {
+            if (t != 0) glDeleteTextures(1, &t);
+            glGenTextures(1, &t);
+            if (!t) return 0;
+            glBindTexture(GL_TEXTURE_2D, t);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            return 1;
         }
+
     	GLuint tex;
+        // Textures of atlas pages 1..n.
+        std::vector<GLuint> pages;
+        // Interleaved client array the vertex sink writes into.
+        std::vector<FONSvertex> vertices;
+        // Index array for FONS_INDEXED_QUADS.
+        std::vector<unsigned short> indices;
+        // Staging buffers of FONS_ASYNC_UPLOADS, used in turn, see GLFONS_PIXEL_BUFFERS.
+        GLuint pixelBuffers[2];
+        int pixelBuffer;
     };
 
 
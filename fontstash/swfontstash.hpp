@@ -0,0 +1,420 @@
+//
+// Copyright (c) 2009-2013 Mikko Mononen memon@inside.org
+//
+// This software is provided 'as-is', without any express or implied
+// warranty.  In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 2. Altered source versions must be plainly marked as such, and must not be
+//    misrepresented as being the original software.
+// 3. This notice may not be removed or altered from any source distribution.
+//
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if !defined(FONS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#   define FONS_SW_SSE2 1
+#   include <emmintrin.h>
+#endif
+
+namespace fontstash {
+    // Software backend. Keeps a copy of every atlas page and composites the
+    // triangles it is given into an RGBA8 framebuffer, so text can be drawn
+    // without a GPU. Colors are packed like glfonsRGBA(), red in the low
+    // byte, and blended with straight alpha over the framebuffer.
+    // With FONS_ZERO_TOPLEFT framebuffer row 0 is y = 0, otherwise y grows
+    // upwards from the bottom row.
+    struct SWFONScontext : FONSparams {
+        SWFONScontext(int w, int h, unsigned char f, int fbWidth, int fbHeight) :
+            FONSparams{w, h, f},
+            fbWidth_{0},
+            fbHeight_{0}
+        {
+            resizeFramebuffer(fbWidth, fbHeight);
+        }
+
+        virtual ~SWFONScontext() = default;
+
+        virtual int renderCreate(int w, int h)
+        {
+            pages_.assign(1, std::vector<unsigned char>(w * h, 0));
+            atlasWidth_ = w;
+            atlasHeight_ = h;
+            return 1;
+        }
+
+        virtual int renderResize(int w, int h)
+        {
+            // The stash uploads everything still in use after a resize.
+            for (auto& page : pages_)
+            {
+                page.assign(w * h, 0);
+            }
+            atlasWidth_ = w;
+            atlasHeight_ = h;
+            return 1;
+        }
+
+        virtual int renderAddPage(int page)
+        {
+            if (page != (int)pages_.size()) return 0;
+            pages_.emplace_back(atlasWidth_ * atlasHeight_, 0);
+            return 1;
+        }
+
+        virtual void renderUpdate(int* rect, const unsigned char* data)
+        {
+            renderUpdatePage(0, rect, data);
+        }
+
+        virtual void renderUpdatePage(int page, int* rect, const unsigned char* data)
+        {
+            if (page < 0 || page >= (int)pages_.size()) return;
+            unsigned char* dst = pages_[page].data();
+            int w = rect[2] - rect[0];
+            for (int y = rect[1]; y < rect[3]; ++y)
+            {
+                memcpy(&dst[rect[0] + y * atlasWidth_], &data[rect[0] + y * atlasWidth_], w);
+            }
+        }
+
+        virtual void renderDraw(const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            renderDrawPage(0, verts, tcoords, colors, nverts);
+        }
+
+        virtual void renderDrawPage(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            if (page < 0 || page >= (int)pages_.size()) return;
+            const unsigned char* tex = pages_[page].data();
+            int i = 0;
+            while (i + 3 <= nverts)
+            {
+                // Glyph quads come as two triangles sharing a diagonal.
+                if (i + 6 <= nverts && isQuad(&verts[i*2], &tcoords[i*2], &colors[i]))
+                {
+                    drawQuad(tex, &verts[i*2], &tcoords[i*2], colors[i]);
+                    i += 6;
+                }
+                else
+                {
+                    drawTriangle(tex, &verts[i*2], &tcoords[i*2], &colors[i]);
+                    i += 3;
+                }
+            }
+        }
+
+        virtual void renderDrawIndexed(int page, const float* verts, const float* tcoords, const unsigned int* colors, int nverts)
+        {
+            if (page < 0 || page >= (int)pages_.size()) return;
+            const unsigned char* tex = pages_[page].data();
+            for (int i = 0; i + 4 <= nverts; i += 4)
+            {
+                const float* v = &verts[i*2];
+                const float* t = &tcoords[i*2];
+                const unsigned int* c = &colors[i];
+                // Corners (x0,y0) (x1,y0) (x1,y1) (x0,y1), see FONS_QUAD_INDICES.
+                if (v[2] == v[4] && v[3] == v[1] && v[6] == v[0] && v[7] == v[5] &&
+                    t[2] == t[4] && t[3] == t[1] && t[6] == t[0] && t[7] == t[5] &&
+                    c[1] == c[0] && c[2] == c[0] && c[3] == c[0])
+                {
+                    const float qv[4] = {v[0], v[1], v[4], v[5]};
+                    const float qt[4] = {t[0], t[1], t[4], t[5]};
+                    drawQuad(tex, qv, qt, c[0]);
+                    continue;
+                }
+                for (int tri = 0; tri < 2; ++tri)
+                {
+                    float tv[6], tt[6];
+                    unsigned int tc[3];
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        int j = FONS_QUAD_INDICES[tri*3+k];
+                        tv[k*2+0] = v[j*2+0];
+                        tv[k*2+1] = v[j*2+1];
+                        tt[k*2+0] = t[j*2+0];
+                        tt[k*2+1] = t[j*2+1];
+                        tc[k] = c[j];
+                    }
+                    drawTriangle(tex, tv, tt, tc);
+                }
+            }
+        }
+
+        virtual void renderDrawInstanced(int page, const FONSinstance* instances, int ninstances)
+        {
+            if (page < 0 || page >= (int)pages_.size()) return;
+            const unsigned char* tex = pages_[page].data();
+            for (int i = 0; i < ninstances; ++i)
+            {
+                FONSquad q;
+                fonsInstanceQuad(instances[i], flags, atlasWidth_, atlasHeight_, &q);
+                const float qv[4] = {q.x0, q.y0, q.x1, q.y1};
+                const float qt[4] = {q.s0, q.t0, q.s1, q.t1};
+                drawQuad(tex, qv, qt, instances[i].c);
+            }
+        }
+
+        virtual void renderDelete()
+        {
+            pages_.clear();
+        }
+
+        void resizeFramebuffer(int w, int h)
+        {
+            fbWidth_ = w;
+            fbHeight_ = h;
+            framebuffer_.assign(w * h * 4, 0);
+        }
+
+        // Fills the framebuffer with a packed RGBA color.
+        void clear(unsigned int color)
+        {
+            uint32_t* p = reinterpret_cast<uint32_t*>(framebuffer_.data());
+            for (int i = 0; i < fbWidth_ * fbHeight_; ++i)
+            {
+                memcpy(&p[i], &color, 4);
+            }
+        }
+
+        // Top row first, 4 bytes per pixel in R, G, B, A order.
+        const unsigned char* pixels() const { return framebuffer_.data(); }
+        int framebufferWidth() const { return fbWidth_; }
+        int framebufferHeight() const { return fbHeight_; }
+
+    private:
+        static int div255(int x)
+        {
+            x += 128;
+            return (x + (x >> 8)) >> 8;
+        }
+
+        // Straight alpha "over", src alpha is coverage times color alpha.
+        static void blendPixel(unsigned char* dst, unsigned int color, int cov)
+        {
+            int a = div255(cov * (int)(color >> 24));
+            int ia = 255 - a;
+            dst[0] = (unsigned char)div255((int)(color & 0xff) * a + dst[0] * ia);
+            dst[1] = (unsigned char)div255((int)((color >> 8) & 0xff) * a + dst[1] * ia);
+            dst[2] = (unsigned char)div255((int)((color >> 16) & 0xff) * a + dst[2] * ia);
+            dst[3] = (unsigned char)div255(255 * a + dst[3] * ia);
+        }
+
+        // Blends a horizontal run of 'n' pixels with one coverage byte each.
+        static void blendSpan(unsigned char* dst, const unsigned char* cov, int n, unsigned int color)
+        {
+            int i = 0;
+#ifdef FONS_SW_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i bias = _mm_set1_epi16(128);
+            const __m128i full = _mm_set1_epi16(255);
+            const __m128i ca = _mm_set1_epi16((short)(color >> 24));
+            // Source color with alpha 255, the same formula then yields the output alpha.
+            const __m128i src = _mm_unpacklo_epi8(_mm_set1_epi32((int)(color | 0xff000000u)), zero);
+            for (; i + 4 <= n; i += 4)
+            {
+                uint32_t c4;
+                memcpy(&c4, &cov[i], 4);
+                if (c4 == 0) continue;
+                __m128i a = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)c4), zero), ca);
+                a = _mm_add_epi16(a, bias);
+                a = _mm_srli_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 8)), 8);
+                a = _mm_unpacklo_epi16(a, a);
+                __m128i a01 = _mm_unpacklo_epi32(a, a);
+                __m128i a23 = _mm_unpackhi_epi32(a, a);
+
+                __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&dst[i*4]));
+                __m128i d01 = _mm_unpacklo_epi8(d, zero);
+                __m128i d23 = _mm_unpackhi_epi8(d, zero);
+                d01 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(src, a01), _mm_mullo_epi16(d01, _mm_sub_epi16(full, a01))), bias);
+                d23 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(src, a23), _mm_mullo_epi16(d23, _mm_sub_epi16(full, a23))), bias);
+                d01 = _mm_srli_epi16(_mm_add_epi16(d01, _mm_srli_epi16(d01, 8)), 8);
+                d23 = _mm_srli_epi16(_mm_add_epi16(d23, _mm_srli_epi16(d23, 8)), 8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i*4]), _mm_packus_epi16(d01, d23));
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                if (cov[i] != 0) blendPixel(&dst[i*4], color, cov[i]);
+            }
+        }
+
+        bool isQuad(const float* v, const float* t, const unsigned int* c) const
+        {
+            // (x0,y0) (x1,y1) (x1,y0)  (x0,y0) (x0,y1) (x1,y1), as emitted by fonsDrawText.
+            return v[6] == v[0] && v[7] == v[1] && v[10] == v[2] && v[11] == v[3] &&
+                   v[4] == v[2] && v[5] == v[1] && v[8] == v[0] && v[9] == v[3] &&
+                   t[6] == t[0] && t[7] == t[1] && t[10] == t[2] && t[11] == t[3] &&
+                   t[4] == t[2] && t[5] == t[1] && t[8] == t[0] && t[9] == t[3] &&
+                   c[1] == c[0] && c[2] == c[0] && c[3] == c[0] && c[4] == c[0] && c[5] == c[0];
+        }
+
+        float rowOf(float y) const
+        {
+            return (flags & FONS_ZERO_TOPLEFT) ? y : (float)fbHeight_ - y;
+        }
+
+        void drawQuad(const unsigned char* tex, const float* v, const float* t, unsigned int color)
+        {
+            float x0 = v[0], x1 = v[2], y0 = rowOf(v[1]), y1 = rowOf(v[3]);
+            float s0 = t[0], s1 = t[2], t0 = t[1], t1 = t[3];
+            if (x1 < x0) { std::swap(x0, x1); std::swap(s0, s1); }
+            if (y1 < y0) { std::swap(y0, y1); std::swap(t0, t1); }
+
+            // Pixels whose centers lie inside the quad.
+            int px0 = maxi((int)std::ceil(x0 - 0.5f), 0);
+            int px1 = mini((int)std::ceil(x1 - 0.5f), fbWidth_);
+            int py0 = maxi((int)std::ceil(y0 - 0.5f), 0);
+            int py1 = mini((int)std::ceil(y1 - 0.5f), fbHeight_);
+            if (px0 >= px1 || py0 >= py1) return;
+
+            // Texel coordinates at pixel centers, nearest sampling in 16.16 fixed point.
+            float dudx = (s1 - s0) * atlasWidth_ / (x1 - x0);
+            float dvdy = (t1 - t0) * atlasHeight_ / (y1 - y0);
+            float u0 = s0 * atlasWidth_ + (px0 + 0.5f - x0) * dudx;
+            float v0 = t0 * atlasHeight_ + (py0 + 0.5f - y0) * dvdy;
+            int n = px1 - px0;
+            int32_t ufix = (int32_t)(u0 * 65536.0f), ustep = (int32_t)(dudx * 65536.0f);
+            // 1:1 mapping, the usual case for glyphs, reads atlas rows directly.
+            bool direct = std::fabs(dudx - 1.0f) < 1e-4f &&
+                          (ufix >> 16) >= 0 && ((ufix + ustep * (n - 1)) >> 16) == (ufix >> 16) + n - 1 &&
+                          (ufix >> 16) + n <= atlasWidth_;
+            if (!direct) row_.resize(n);
+
+            for (int py = py0; py < py1; ++py)
+            {
+                int ty = (int)std::floor(v0 + (py - py0) * dvdy);
+                if (ty < 0 || ty >= atlasHeight_) continue;
+                const unsigned char* texRow = &tex[ty * atlasWidth_];
+                const unsigned char* cov;
+                if (direct)
+                {
+                    cov = &texRow[ufix >> 16];
+                }
+                else
+                {
+                    int32_t u = ufix;
+                    for (int i = 0; i < n; ++i, u += ustep)
+                    {
+                        int tx = u >> 16;
+                        row_[i] = (tx >= 0 && tx < atlasWidth_) ? texRow[tx] : 0;
+                    }
+                    cov = row_.data();
+                }
+                blendSpan(&framebuffer_[(px0 + py * fbWidth_) * 4], cov, n, color);
+            }
+        }
+
+        void drawTriangle(const unsigned char* tex, const float* v, const float* t, const unsigned int* c)
+        {
+            float x[3], y[3], s[3], tt[3];
+            unsigned int col[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                x[k] = v[k*2];
+                y[k] = rowOf(v[k*2+1]);
+                s[k] = t[k*2];
+                tt[k] = t[k*2+1];
+                col[k] = c[k];
+            }
+            float area = edge(x, y, 0, 1, x[2], y[2]);
+            if (area == 0.0f) return;
+            // One winding for every triangle, so shared edges are owned by exactly one side.
+            if (area < 0.0f)
+            {
+                std::swap(x[1], x[2]);
+                std::swap(y[1], y[2]);
+                std::swap(s[1], s[2]);
+                std::swap(tt[1], tt[2]);
+                std::swap(col[1], col[2]);
+                area = -area;
+            }
+
+            int px0 = maxi((int)std::floor(std::fmin(x[0], std::fmin(x[1], x[2]))), 0);
+            int px1 = mini((int)std::ceil(std::fmax(x[0], std::fmax(x[1], x[2]))), fbWidth_);
+            int py0 = maxi((int)std::floor(std::fmin(y[0], std::fmin(y[1], y[2]))), 0);
+            int py1 = mini((int)std::ceil(std::fmax(y[0], std::fmax(y[1], y[2]))), fbHeight_);
+
+            for (int py = py0; py < py1; ++py)
+            {
+                float sy = py + 0.5f;
+                for (int px = px0; px < px1; ++px)
+                {
+                    float sx = px + 0.5f;
+                    float e0 = edge(x, y, 1, 2, sx, sy);
+                    float e1 = edge(x, y, 2, 0, sx, sy);
+                    float e2 = edge(x, y, 0, 1, sx, sy);
+                    if (!inside(e0, x[2] - x[1], y[2] - y[1]) ||
+                        !inside(e1, x[0] - x[2], y[0] - y[2]) ||
+                        !inside(e2, x[1] - x[0], y[1] - y[0]))
+                        continue;
+
+                    // Barycentric weights of the pixel center.
+                    float w0 = e0 / area, w1 = e1 / area, w2 = e2 / area;
+                    int tx = (int)std::floor((w0 * s[0] + w1 * s[1] + w2 * s[2]) * atlasWidth_);
+                    int ty = (int)std::floor((w0 * tt[0] + w1 * tt[1] + w2 * tt[2]) * atlasHeight_);
+                    if (tx < 0 || tx >= atlasWidth_ || ty < 0 || ty >= atlasHeight_) continue;
+                    int cov = tex[tx + ty * atlasWidth_];
+                    if (cov == 0) continue;
+
+                    unsigned int color = 0;
+                    for (int ch = 0; ch < 32; ch += 8)
+                    {
+                        float val = w0 * ((col[0] >> ch) & 0xff) + w1 * ((col[1] >> ch) & 0xff) + w2 * ((col[2] >> ch) & 0xff);
+                        color |= (unsigned int)mini((int)(val + 0.5f), 255) << ch;
+                    }
+                    blendPixel(&framebuffer_[(px + py * fbWidth_) * 4], color, cov);
+                }
+            }
+        }
+
+        static float edge(const float* x, const float* y, int a, int b, float px, float py)
+        {
+            return (x[b] - x[a]) * (py - y[a]) - (y[b] - y[a]) * (px - x[a]);
+        }
+
+        // Pixels exactly on an edge belong to the triangle for only one of the
+        // two directions the edge can have.
+        static bool inside(float e, float dx, float dy)
+        {
+            return e > 0.0f || (e == 0.0f && (dy > 0.0f || (dy == 0.0f && dx > 0.0f)));
+        }
+
+        std::vector<std::vector<unsigned char>> pages_;
+        int atlasWidth_ = 0, atlasHeight_ = 0;
+        std::vector<unsigned char> framebuffer_;
+        std::vector<unsigned char> row_;
+        int fbWidth_, fbHeight_;
+    };
+
+    inline FONScontext* swfonsCreate(int width, int height, int flags, int fbWidth, int fbHeight)
+    {
+        return new FONScontext(new SWFONScontext(width, height, (unsigned char)flags, fbWidth, fbHeight));
+    }
+
+    // The backend of a context made by swfonsCreate(), to read its pixels.
+    inline SWFONScontext* swfonsBackend(FONScontext* ctx)
+    {
+        return static_cast<SWFONScontext*>(ctx->params.get());
+    }
+
+    inline void swfonsDelete(FONScontext* ctx)
+    {
+        delete ctx;
+    }
+
+    inline unsigned int swfonsRGBA(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+    {
+        return (r) | (g << 8) | (b << 16) | (a << 24);
+    }
+}